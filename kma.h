@@ -74,6 +74,60 @@
 
 typedef int kma_size_t;
 
+// with thread caches (kma_tcache.c), per-thread heaps (kma_heap.c) or
+// magazines (kma_magazine.c) the allocator is the backend
+#if (defined(KMA_TCACHE) || defined(KMA_HEAP) || defined(KMA_MAGAZINE)) && \
+  defined(__KMA_IMPL__)
+#define kma_malloc kma_backend_malloc
+#define kma_free kma_backend_free
+#endif
+
+// a per-thread heap is the single threaded allocator with its roots
+// (KMA_LOCAL) in thread-local variables, only the pages are shared
+#if defined(KMA_HEAP) && defined(__KMA_IMPL__)
+#undef KMA_CONCURRENT
+#define KMA_LOCAL __thread
+#else
+#define KMA_LOCAL
+#endif
+
+// the roots of a heap: its entry page and the count of blocks out,
+// if the allocator keeps it outside of its pages
+typedef struct
+{
+  void* root;
+  int count;
+} kma_heap_t;
+
+// where the bytes of the pages in use go besides the requests: requests
+// rounded up to their block size, free blocks and free space in the
+// pages, and the headers of the allocator in the pages (page and
+// controller structures, bitmaps, kma_page_t* back pointers). What is
+// left is lost in a way the allocator does not count.
+typedef struct
+{
+  long rounding;
+  long free;
+  long header;
+} kma_waste_t;
+
+// the single threaded correctness builds count their waste for
+// kma_waste.dat, the others keep it off their fast paths
+#if !defined(COMPETITION) && !defined(KMA_CONCURRENT) && \
+  !defined(KMA_TCACHE) && !defined(KMA_HEAP) && !defined(KMA_MAGAZINE)
+#define KMA_WASTE
+#endif
+
+#ifdef KMA_WASTE
+#define WASTE(field, bytes) (waste_count.field += (bytes))
+#define WASTE_RESET() (waste_count.rounding = waste_count.free = \
+		       waste_count.header = 0)
+#else
+//bytes only computed for the count stay used
+#define WASTE(field, bytes) ((void) (bytes))
+#define WASTE_RESET() ((void) 0)
+#endif
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -100,6 +154,70 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#ifdef KMA_TCACHE
+/***********************************************************************
+ *  Title: Thread caches
+ * ---------------------------------------------------------------------
+ *    Purpose: The allocator behind the thread caches, the number of
+ *             blocks a cache keeps for a size (0 turns them off) and
+ *             remote frees on or off (set them before the threads
+ *             start), and the cache hits, misses and blocks taken from
+ *             remote-free lists of the threads that exited and of this
+ *             thread
+ ***********************************************************************/
+void* kma_backend_malloc(kma_size_t size);
+void kma_backend_free(void*, kma_size_t size);
+void kma_tcache_depth(int);
+void kma_tcache_remote(bool);
+void kma_tcache_stats(long*, long*, long*);
+#endif
+
+#ifdef KMA_HEAP
+/***********************************************************************
+ *  Title: Per-thread heaps
+ * ---------------------------------------------------------------------
+ *    Purpose: The allocator behind the heaps, and the move of a heap
+ *             to another thread: kma_heap_save takes the roots of the
+ *             heap of this thread and leaves it empty, kma_heap_load
+ *             gives them to the (empty) heap of this thread. A block
+ *             must be freed by the thread whose heap it came from.
+ *             kma_heap_stats gives the heaps left with blocks by
+ *             exiting threads and the ones adopted
+ ***********************************************************************/
+void* kma_backend_malloc(kma_size_t size);
+void kma_backend_free(void*, kma_size_t size);
+void kma_heap_save(kma_heap_t*);
+void kma_heap_load(kma_heap_t*);
+void kma_heap_stats(long*, long*);
+#endif
+
+#ifdef KMA_MAGAZINE
+/***********************************************************************
+ *  Title: Magazines
+ * ---------------------------------------------------------------------
+ *    Purpose: The allocator behind the magazines, the blocks a
+ *             magazine starts with (0 turns them off, set it before the
+ *             threads start), the return of the cached blocks to the
+ *             allocator (of the depot, or with all of the CPUs too) and
+ *             the hits, misses, depot exchanges and the largest M
+ ***********************************************************************/
+void* kma_backend_malloc(kma_size_t size);
+void kma_backend_free(void*, kma_size_t size);
+void kma_magazine_size(int);
+void kma_magazine_reclaim(bool);
+void kma_magazine_stats(long*, long*, long*, int*);
+#endif
+
+#ifdef KMA_WASTE
+/***********************************************************************
+ *  Title: Waste breakdown
+ * ---------------------------------------------------------------------
+ *    Purpose: The bytes of the pages in use the allocator has rounded
+ *             up, free and as headers right now
+ ***********************************************************************/
+void kma_waste(kma_waste_t*);
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
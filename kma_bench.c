@@ -0,0 +1,341 @@
+/***************************************************************************
+ *  Title: Benchmark Driver
+ * -------------------------------------------------------------------------
+ *    Purpose: Replays every trace against every allocator in one
+ *             process (the allocators of kma_bench.h). A trace is read
+ *             once, checked once for the waste ratio, the peak pages,
+ *             the most bytes of the pool in memory and the page
+ *             faults, then replayed warmup times untimed and reps
+ *             times timed. With -c one more replay runs with the
+ *             hardware counters of kma_perf.h on, around every
+ *             allocator call or around the whole replay. The results
+ *             go to a table, a CSV and a JSON file for tracking them
+ *             over time.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_bench.h"
+#include "kma_perf.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct
+{
+  char* trace;
+  char* name;
+  int reps;
+  double mean; // seconds of a replay
+  double stddev;
+  double min;
+  double ratio; // the competition average ratio of wasted to used
+  int peak; // pages in use
+  double score; // min * (1 + ratio), the competition score
+  long rss; // the most bytes of the pool in memory
+  long faults; // minor page faults of the checked replay
+  double counters[PERF_COUNTERS]; // per operation, NAN if not counted
+} result_t;
+
+// what the counters are on for
+#define COUNT_NONE 0
+#define COUNT_CALLS 1 // the allocator calls only
+#define COUNT_REPLAY 2 // the whole replay, with the loop around the calls
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void counted_replay(trace_t*, backend_t*, int, double*);
+void write_results(char*, result_t*, int, long);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+static char* name = NULL;
+
+static char* usage[] =
+  {
+    "[-w warmup] [-n reps] [-a algorithm]... [-o output] [-c calls|replay] "
+    "traceFile [traceFile...]",
+    "writes output.csv and output.json (kma_bench)",
+    "-c counts cycles, cache misses... of the allocator calls or the replay",
+    NULL
+  };
+
+int
+main(int argc, char* argv[])
+{
+  int opt, i, j, r, n_results = 0, warmup = 1, reps = 5;
+  int use[N_BACKENDS], any = 0, count = COUNT_NONE;
+  char* output = "kma_bench";
+
+  name = argv[0];
+  memset(use, 0, sizeof(use));
+  while ((opt = getopt(argc, argv, "w:n:a:o:c:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'w':
+	  warmup = atoi(optarg);
+	  break;
+	case 'n':
+	  reps = atoi(optarg);
+	  break;
+	case 'a':
+	  if ((j = find_backend(optarg)) < 0)
+	    error("unknown algorithm", optarg);
+	  use[j] = any = 1;
+	  break;
+	case 'o':
+	  output = optarg;
+	  break;
+	case 'c':
+	  if (strcmp(optarg, "calls") == 0)
+	    count = COUNT_CALLS;
+	  else if (strcmp(optarg, "replay") == 0)
+	    count = COUNT_REPLAY;
+	  else
+	    error("unknown counter mode", optarg);
+	  break;
+	default:
+	  usage_exit(name, usage);
+	}
+    }
+  if (optind >= argc || warmup < 0 || reps < 1)
+    usage_exit(name, usage);
+  if (!any)
+    for (j = 0; j < N_BACKENDS; j++)
+      use[j] = 1;
+  // without any counter the -c replays are left out
+  if (count != COUNT_NONE && perf_init() == 0)
+    count = COUNT_NONE;
+
+  int n_traces = argc - optind;
+  trace_t** traces = malloc(n_traces * sizeof(trace_t*));
+  result_t* results = malloc(n_traces * N_BACKENDS * sizeof(result_t));
+
+  // read all traces before the first replay
+  for (i = 0; i < n_traces; i++)
+    traces[i] = read_trace(argv[optind + i]);
+
+  printf("%-20s %-10s %10s %10s %10s %9s %6s %10s %9s %7s\n", "trace",
+	 "algorithm", "mean (s)", "stddev", "min (s)", "ratio", "peak",
+	 "score", "rss (KB)", "faults");
+  for (i = 0; i < n_traces; i++)
+    {
+      replay_tables(traces[i]);
+      for (j = 0; j < N_BACKENDS; j++)
+	{
+	  result_t* res = &results[n_results];
+	  replay_stat_t stat;
+	  double sum = 0.0, sum2 = 0.0;
+
+	  if (!use[j])
+	    continue;
+	  n_results++;
+	  res->trace = argv[optind + i];
+	  res->name = backends[j].name;
+	  res->reps = reps;
+	  check_replay(traces[i], &backends[j], &stat);
+	  res->ratio = stat.ratio;
+	  res->peak = stat.peak;
+	  res->rss = stat.peak_resident;
+	  res->faults = stat.faults;
+
+	  for (r = 0; r < warmup; r++)
+	    timed_replay(traces[i], &backends[j]);
+	  res->min = 0.0;
+	  for (r = 0; r < reps; r++)
+	    {
+	      double t = timed_replay(traces[i], &backends[j]);
+
+	      sum += t;
+	      sum2 += t * t;
+	      if (r == 0 || t < res->min)
+		res->min = t;
+	    }
+	  res->mean = sum / reps;
+	  res->stddev = reps > 1 ?
+	    sqrt((sum2 - sum * sum / reps) / (reps - 1)) : 0.0;
+	  if (res->stddev != res->stddev) // rounding below 0
+	    res->stddev = 0.0;
+	  res->score = res->min * (1 + res->ratio);
+	  for (r = 0; r < PERF_COUNTERS; r++)
+	    res->counters[r] = NAN;
+	  if (count != COUNT_NONE)
+	    counted_replay(traces[i], &backends[j], count, res->counters);
+
+	  printf("%-20s %-10s %10.6f %10.6f %10.6f %9.6f %6d %10.6f %9ld "
+		 "%7ld\n", res->trace, res->name, res->mean, res->stddev,
+		 res->min, res->ratio, res->peak, res->score, res->rss / 1024,
+		 res->faults);
+	}
+    }
+
+  if (count != COUNT_NONE)
+    {
+      printf("\ncounters per operation (%s)\n%-20s %-10s", count == COUNT_CALLS
+	     ? "allocator calls" : "whole replay", "trace", "algorithm");
+      for (r = 0; r < PERF_COUNTERS; r++)
+	if (perf_fd[r] >= 0)
+	  printf(" %13s", perf_events[r].name);
+      printf("\n");
+      for (i = 0; i < n_results; i++)
+	{
+	  printf("%-20s %-10s", results[i].trace, results[i].name);
+	  for (r = 0; r < PERF_COUNTERS; r++)
+	    if (perf_fd[r] >= 0)
+	      printf(" %13.2f", results[i].counters[r]);
+	  printf("\n");
+	}
+    }
+
+  write_results(output, results, n_results, (long) time(NULL));
+  return 0;
+}
+
+// one more replay with the counters on, what they count per operation
+// goes to counters. Around every call the counters are switched on and
+// off, which counts too: what that counts alone (measured by perf_init)
+// comes off for every call.
+void
+counted_replay(trace_t* trace, backend_t* b, int count, double* counters)
+{
+  kma_trace_op_t* op = trace->ops;
+  kma_trace_op_t* end = trace->ops + trace->n_ops;
+  int i, calls = 0;
+
+  perf_reset();
+  if (count == COUNT_REPLAY)
+    perf_on();
+  for (; op < end; op++)
+    {
+      if (op->op == TRACE_REQUEST)
+	{
+	  if (count == COUNT_CALLS)
+	    perf_on();
+	  blocks[op->id] = b->malloc(op->size);
+	  if (count == COUNT_CALLS)
+	    perf_off();
+	  sizes[op->id] = op->size;
+	  calls++;
+	}
+      else if (blocks[op->id])
+	{
+	  if (count == COUNT_CALLS)
+	    perf_on();
+	  b->free(blocks[op->id], sizes[op->id]);
+	  if (count == COUNT_CALLS)
+	    perf_off();
+	  blocks[op->id] = NULL;
+	  calls++;
+	}
+    }
+  if (count == COUNT_REPLAY)
+    perf_off();
+
+  perf_read(counters);
+  for (i = 0; i < PERF_COUNTERS; i++)
+    {
+      if (count == COUNT_CALLS)
+	counters[i] -= calls * perf_overhead[i];
+      if (counters[i] < 0.0)
+	counters[i] = 0.0;
+      counters[i] /= trace->n_ops;
+    }
+}
+
+// a counter as a CSV field and a JSON value, empty or null if it was not
+// counted
+static void
+write_counter(FILE* csv, FILE* json, double value)
+{
+  if (isnan(value))
+    {
+      fprintf(csv, ",");
+      fprintf(json, "null");
+    }
+  else
+    {
+      fprintf(csv, ",%.4f", value);
+      fprintf(json, "%.4f", value);
+    }
+}
+
+// the results as CSV and JSON, every row with the time of the run so
+// the files of several runs can be put together
+void
+write_results(char* output, result_t* results, int n, long when)
+{
+  char file[256];
+  FILE* csv;
+  FILE* json;
+  int i, k;
+
+  snprintf(file, sizeof(file), "%s.csv", output);
+  if ((csv = fopen(file, "w")) == NULL)
+    error("unable to open output file", file);
+  snprintf(file, sizeof(file), "%s.json", output);
+  if ((json = fopen(file, "w")) == NULL)
+    error("unable to open output file", file);
+
+  fprintf(csv, "time,trace,algorithm,reps,mean,stddev,min,ratio,peak,"
+	  "score,peak_rss,faults");
+  for (k = 0; k < PERF_COUNTERS; k++)
+    fprintf(csv, ",%s", perf_events[k].name);
+  fprintf(csv, "\n");
+  fprintf(json, "{\n  \"time\": %ld,\n  \"results\": [", when);
+  for (i = 0; i < n; i++)
+    {
+      result_t* r = &results[i];
+
+      fprintf(csv, "%ld,%s,%s,%d,%.9f,%.9f,%.9f,%.6f,%d,%.9f,%ld,%ld", when,
+	      r->trace, r->name, r->reps, r->mean, r->stddev, r->min,
+	      r->ratio, r->peak, r->score, r->rss, r->faults);
+      fprintf(json, "%s\n    {\"trace\": \"%s\", \"algorithm\": \"%s\", "
+	      "\"reps\": %d, \"mean\": %.9f, \"stddev\": %.9f, "
+	      "\"min\": %.9f, \"ratio\": %.6f, \"peak\": %d, "
+	      "\"score\": %.9f, \"peak_rss\": %ld, \"faults\": %ld, "
+	      "\"counters\": {", i ? "," : "", r->trace, r->name, r->reps,
+	      r->mean, r->stddev, r->min, r->ratio, r->peak, r->score, r->rss,
+	      r->faults);
+      for (k = 0; k < PERF_COUNTERS; k++)
+	{
+	  fprintf(json, "%s\"%s\": ", k ? ", " : "", perf_events[k].name);
+	  write_counter(csv, json, r->counters[k]);
+	}
+      fprintf(csv, "\n");
+      fprintf(json, "}}");
+    }
+  fprintf(json, "\n  ]\n}\n");
+  fclose(csv);
+  fclose(json);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  printf("Test: FAILED\n");
+  exit(-1);
+}
@@ -0,0 +1,268 @@
+/***************************************************************************
+ *  Title: Benchmark Backends
+ * -------------------------------------------------------------------------
+ *    Purpose: The allocators kma_bench and kma_micro link together, and
+ *             the replay loops they share. Every allocator is built
+ *             into its own object with kma_malloc/kma_free renamed
+ *             (kma_bud_malloc...) and its other symbols made local, so
+ *             they share the page pool and take turns on it.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_BENCH_H__
+#define __KMA_BENCH_H__
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct
+{
+  char* name;
+  void* (*malloc)(kma_size_t);
+  void (*free)(void*, kma_size_t);
+} backend_t;
+
+// what the checked replay of a trace measured
+typedef struct
+{
+  double ratio; // the competition average ratio of wasted to used
+  int peak; // pages in use
+  int peak_bytes; // bytes of the requests in use at the same time
+  long peak_resident; // bytes of the pool in memory (pool_resident)
+  long faults; // minor page faults of the replay
+} replay_stat_t;
+
+// operations between two looks at the resident pool in check_replay
+#define RSS_EVERY 256
+
+/************Function Prototypes******************************************/
+void* kma_rm_malloc(kma_size_t);
+void kma_rm_free(void*, kma_size_t);
+void* kma_p2fl_malloc(kma_size_t);
+void kma_p2fl_free(void*, kma_size_t);
+void* kma_mck2_malloc(kma_size_t);
+void kma_mck2_free(void*, kma_size_t);
+void* kma_bud_malloc(kma_size_t);
+void kma_bud_free(void*, kma_size_t);
+void* kma_lzbud_malloc(kma_size_t);
+void kma_lzbud_free(void*, kma_size_t);
+
+/************Global Variables*********************************************/
+
+static backend_t backends[] =
+  {
+    { "KMA_RM",    kma_rm_malloc,    kma_rm_free    },
+    { "KMA_P2FL",  kma_p2fl_malloc,  kma_p2fl_free  },
+    { "KMA_MCK2",  kma_mck2_malloc,  kma_mck2_free  },
+    { "KMA_BUD",   kma_bud_malloc,   kma_bud_free   },
+    { "KMA_LZBUD", kma_lzbud_malloc, kma_lzbud_free },
+  };
+
+#define N_BACKENDS ((int) (sizeof(backends) / sizeof(backend_t)))
+
+// the blocks of the trace that is replayed and their sizes, by request
+// id (a FREE record has no size)
+static void** blocks = NULL;
+static int* sizes = NULL;
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Backend lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: The index of an allocator by its name, with or without
+ *             the KMA_ and in any case (-1 if there is none)
+ ***********************************************************************/
+static int
+find_backend(char* name)
+{
+  int i;
+
+  for (i = 0; i < N_BACKENDS; i++)
+    if (strcasecmp(name, backends[i].name) == 0 ||
+	strcasecmp(name, backends[i].name + 4) == 0)
+      return i;
+  return -1;
+}
+
+/***********************************************************************
+ *  Title: Usage
+ * ---------------------------------------------------------------------
+ *    Purpose: Print the usage of a program, its arguments and then more
+ *             lines of help (up to a NULL), and exit with 1: for an
+ *             option getopt does not know as well as for missing
+ *             arguments
+ ***********************************************************************/
+static inline void
+usage_exit(char* program, char** lines)
+{
+  int i;
+
+  printf("Usage: %s %s\n", program, lines[0]);
+  for (i = 1; lines[i] != NULL; i++)
+    printf("       %s\n", lines[i]);
+  exit(1);
+}
+
+/***********************************************************************
+ *  Title: Replays
+ * ---------------------------------------------------------------------
+ *    Purpose: check_replay replays a trace like the competition
+ *             harness, with the page stats after every operation and
+ *             the resident pool every RSS_EVERY operations (blocks are
+ *             written once in every 4 KB), and fails
+ *             if the allocator turns down a request that fits a page
+ *             or keeps pages at the end. timed_replay does the
+ *             same operations without stats and returns the seconds.
+ ***********************************************************************/
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// make room for the requests of a trace
+static void
+replay_tables(trace_t* trace)
+{
+  blocks = realloc(blocks, (trace->n_req + 1) * sizeof(void*));
+  sizes = realloc(sizes, (trace->n_req + 1) * sizeof(int));
+  memset(blocks, 0, (trace->n_req + 1) * sizeof(void*));
+}
+
+// write a byte of every 4 KB of a block like a program that uses it, so
+// the resident pool has the pages of the blocks and not only those the
+// allocator writes itself (a block of 0 bytes has nothing to touch)
+static inline void
+replay_touch(char* ptr, int size)
+{
+  int i;
+
+  if (size <= 0)
+    return;
+  for (i = 0; i < size; i += 4096)
+    ptr[i] = 0;
+  ptr[size - 1] = 0;
+}
+
+static inline void
+replay_resident(replay_stat_t* res)
+{
+  long resident = pool_resident();
+
+  if (resident > res->peak_resident)
+    res->peak_resident = resident;
+}
+
+static inline void
+check_replay(trace_t* trace, backend_t* b, replay_stat_t* res)
+{
+  int i, n_alloc = 0, n_dealloc = 0, in_use = 0, count = 0, pages;
+  double sum = 0.0;
+
+  res->peak = 0;
+  res->peak_bytes = 0;
+  res->peak_resident = 0;
+  res->faults = minor_faults();
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      kma_trace_op_t* op = &trace->ops[i];
+
+      if (op->op == TRACE_REQUEST)
+	{
+	  blocks[op->id] = b->malloc(op->size);
+	  sizes[op->id] = op->size;
+	  if (blocks[op->id] == NULL && op->size <= PAGESIZE - sizeof(void*))
+	    error("got NULL from kma_malloc for alloc'able request", b->name);
+	  if (blocks[op->id])
+	    {
+	      in_use += op->size;
+	      replay_touch(blocks[op->id], op->size);
+	    }
+	  n_alloc++;
+	}
+      else
+	{
+	  // the allocator may have turned the request down
+	  if (blocks[op->id])
+	    {
+	      // the pool goes when its last page comes back, and the
+	      // resident bytes only go down with it
+	      if (in_use == sizes[op->id])
+		replay_resident(res);
+	      b->free(blocks[op->id], sizes[op->id]);
+	      in_use -= sizes[op->id];
+	      blocks[op->id] = NULL;
+	    }
+	  n_dealloc++;
+	}
+
+      pages = pages_in_use();
+      if (pages > res->peak)
+	res->peak = pages;
+      if (in_use > res->peak_bytes)
+	res->peak_bytes = in_use;
+      // the same points as the competition harness
+      if (n_alloc != n_dealloc && in_use > 0)
+	{
+	  sum += (double) (pages * PAGESIZE - in_use) / in_use;
+	  count++;
+	}
+      if (i % RSS_EVERY == 0)
+	replay_resident(res);
+    }
+  res->faults = minor_faults() - res->faults;
+
+  if (pages_in_use() != 0)
+    error("not all pages freed by", b->name);
+  res->ratio = count ? sum / count : 0.0;
+}
+
+static inline double
+timed_replay(trace_t* trace, backend_t* b)
+{
+  kma_trace_op_t* op = trace->ops;
+  kma_trace_op_t* end = trace->ops + trace->n_ops;
+  double start = now();
+
+  for (; op < end; op++)
+    {
+      if (op->op == TRACE_REQUEST)
+	{
+	  blocks[op->id] = b->malloc(op->size);
+	  sizes[op->id] = op->size;
+	}
+      else if (blocks[op->id])
+	{
+	  b->free(blocks[op->id], sizes[op->id]);
+	  blocks[op->id] = NULL;
+	}
+    }
+  return now() - start;
+}
+
+#endif /* __KMA_BENCH_H__ */
@@ -0,0 +1,216 @@
+/***************************************************************************
+ *  Title: Bitmap Kernels
+ * -------------------------------------------------------------------------
+ *    Purpose: Word-at-a-time bitmap operations shared by the buddy
+ *             allocators
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_BITMAP_H__
+#define __KMA_BITMAP_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define WORDBITS 64
+
+/***********************************************************************
+ *  Title: Bitmap Size Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Number of words needed for a bitmap of n bits
+ *    Input: number of bits
+ *    Output: number of words
+ ***********************************************************************/
+#define BITMAP_WORDS(n) (((n) + WORDBITS - 1) / WORDBITS)
+
+typedef unsigned long long kma_word_t;
+
+/***********************************************************************
+ *  Title: Word updates
+ * ---------------------------------------------------------------------
+ *    Purpose: Or, and, xor a mask into a word (WORD_XOR gives the new
+ *             word). In the concurrent mode blocks of different orders
+ *             share words and are changed under different locks, so the
+ *             updates are atomic. Full words in a run belong to one
+ *             block and are only stored (WORD_STORE), but a thread
+ *             looking at a larger block may read them at the same time.
+ ***********************************************************************/
+#ifdef KMA_CONCURRENT
+#define WORD_OR(w, m) __atomic_fetch_or((w), (m), __ATOMIC_RELAXED)
+#define WORD_AND(w, m) __atomic_fetch_and((w), (m), __ATOMIC_RELAXED)
+#define WORD_XOR(w, m) __atomic_xor_fetch((w), (m), __ATOMIC_RELAXED)
+#define WORD_LOAD(w) __atomic_load_n((w), __ATOMIC_RELAXED)
+#define WORD_STORE(w, v) __atomic_store_n((w), (v), __ATOMIC_RELAXED)
+#else
+#define WORD_OR(w, m) (*(w) |= (m))
+#define WORD_AND(w, m) (*(w) &= (m))
+#define WORD_XOR(w, m) (*(w) ^= (m))
+#define WORD_LOAD(w) (*(w))
+#define WORD_STORE(w, v) (*(w) = (v))
+#endif
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Word helpers
+ * ---------------------------------------------------------------------
+ *    Purpose: Count trailing zeros (w must not be zero), count the set
+ *             bits, and build a mask of n ones starting at offset
+ *             (1 <= n, offset + n <= WORDBITS)
+ ***********************************************************************/
+static inline int
+word_ctz(kma_word_t w)
+{
+  return __builtin_ctzll(w);
+}
+
+static inline int
+word_popcount(kma_word_t w)
+{
+  return __builtin_popcountll(w);
+}
+
+static inline kma_word_t
+run_mask(int offset, int n)
+{
+  return (~0ULL >> (WORDBITS - n)) << offset;
+}
+
+/***********************************************************************
+ *  Title: Single bit operations
+ * ---------------------------------------------------------------------
+ *    Purpose: Set, clear, read and flip the bit at pos; bitmap_toggle
+ *             returns the new value of the bit
+ ***********************************************************************/
+static inline void
+bitmap_set(kma_word_t map[], unsigned int pos)
+{
+  WORD_OR(&map[pos / WORDBITS], 1ULL << (pos % WORDBITS));
+}
+
+static inline void
+bitmap_clear(kma_word_t map[], unsigned int pos)
+{
+  WORD_AND(&map[pos / WORDBITS], ~(1ULL << (pos % WORDBITS)));
+}
+
+static inline int
+bitmap_get(kma_word_t map[], unsigned int pos)
+{
+  return (WORD_LOAD(&map[pos / WORDBITS]) >> (pos % WORDBITS)) & 1;
+}
+
+static inline int
+bitmap_toggle(kma_word_t map[], unsigned int pos)
+{
+  kma_word_t w = WORD_XOR(&map[pos / WORDBITS], 1ULL << (pos % WORDBITS));
+
+  return (w >> (pos % WORDBITS)) & 1;
+}
+
+/***********************************************************************
+ *  Title: Run operations
+ * ---------------------------------------------------------------------
+ *    Purpose: Set, clear or test the n bits starting at pos. A run
+ *             inside one word is a single mask operation, longer runs
+ *             touch every word once. Buddy blocks are aligned to their
+ *             size, so their runs never have a partial head and tail
+ *             in the same call.
+ *    Input: the bitmap, the first bit and the length of the run
+ ***********************************************************************/
+static inline void
+bitmap_set_run(kma_word_t map[], unsigned int pos, int n)
+{
+  kma_word_t* w = &map[pos / WORDBITS];
+  int offset = pos % WORDBITS;
+
+  if (offset + n <= WORDBITS)
+    {
+      WORD_OR(w, run_mask(offset, n));
+      return;
+    }
+  if (offset)
+    {
+      WORD_OR(w, run_mask(offset, WORDBITS - offset));
+      w++;
+      n -= WORDBITS - offset;
+    }
+  for (; n >= WORDBITS; n -= WORDBITS)
+    WORD_STORE(w++, ~0ULL);
+  if (n)
+    WORD_OR(w, run_mask(0, n));
+}
+
+static inline void
+bitmap_clear_run(kma_word_t map[], unsigned int pos, int n)
+{
+  kma_word_t* w = &map[pos / WORDBITS];
+  int offset = pos % WORDBITS;
+
+  if (offset + n <= WORDBITS)
+    {
+      WORD_AND(w, ~run_mask(offset, n));
+      return;
+    }
+  if (offset)
+    {
+      WORD_AND(w, ~run_mask(offset, WORDBITS - offset));
+      w++;
+      n -= WORDBITS - offset;
+    }
+  for (; n >= WORDBITS; n -= WORDBITS)
+    WORD_STORE(w++, 0);
+  if (n)
+    WORD_AND(w, ~run_mask(0, n));
+}
+
+// TRUE if none of the n bits at pos is set
+static inline int
+bitmap_run_is_clear(kma_word_t map[], unsigned int pos, int n)
+{
+  kma_word_t* w = &map[pos / WORDBITS];
+  int offset = pos % WORDBITS;
+  kma_word_t acc;
+
+  if (offset + n <= WORDBITS)
+    return (WORD_LOAD(w) & run_mask(offset, n)) == 0;
+  acc = 0;
+  if (offset)
+    {
+      acc |= WORD_LOAD(w) & run_mask(offset, WORDBITS - offset);
+      w++;
+      n -= WORDBITS - offset;
+    }
+  for (; n >= WORDBITS; n -= WORDBITS)
+    acc |= WORD_LOAD(w++);
+  if (n)
+    acc |= WORD_LOAD(w) & run_mask(0, n);
+  return acc == 0;
+}
+
+// number of set bits in the first nwords words
+static inline int
+bitmap_count(kma_word_t map[], int nwords)
+{
+  int i, count = 0;
+
+  for (i = 0; i < nwords; i++)
+    count += word_popcount(map[i]);
+  return count;
+}
+
+#endif /* __KMA_BITMAP_H__ */
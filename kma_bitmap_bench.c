@@ -0,0 +1,147 @@
+/***************************************************************************
+ *  Title: Bitmap Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Times a set, a test and a clear of one aligned run of
+ *             bits, the operations of the KMA_LZBUD page bitmap, with
+ *             the run kernels of kma_bitmap.h and with the bit at a time
+ *             loops over 32-bit words KMA_LZBUD had before them, for
+ *             runs of 1 to 128 bits
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_bitmap.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// bits of the bitmap, a page of 32-byte granules
+#define MAPBITS 256
+
+// the longest run
+#define MAXRUN 128
+
+/************Global Variables*********************************************/
+
+static kma_word_t new_map[BITMAP_WORDS(MAPBITS)];
+static unsigned int old_map[MAPBITS / 32];
+
+// what the tests returned, so they are not left out
+static volatile int sink = 0;
+
+/************Function Prototypes******************************************/
+double run_new(int, long);
+double run_old(int, long);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  long iters = 10000000;
+  int n;
+
+  if (argc > 2 || (argc == 2 && (iters = atol(argv[1])) < 1))
+    {
+      printf("Usage: %s [iterations]\n", argv[0]);
+      exit(1);
+    }
+
+  printf("set + test + clear of one aligned run, ns per triple\n");
+  printf("%6s %8s %8s\n", "bits", "old", "new");
+  for (n = 1; n <= MAXRUN; n *= 2)
+    printf("%6d %8.1f %8.1f\n", n, run_old(n, iters), run_new(n, iters));
+  return 0;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one triple on the run of n bits at pos, not inlined into the loop so
+// neither version is unrolled across triples
+static __attribute__((noinline)) void
+triple_new(unsigned int pos, int n)
+{
+  bitmap_set_run(new_map, pos, n);
+  sink += bitmap_run_is_clear(new_map, pos, n);
+  bitmap_clear_run(new_map, pos, n);
+}
+
+// the set_bit, get_bit and unset_bit loops of KMA_LZBUD before
+// kma_bitmap.h
+static __attribute__((noinline)) void
+triple_old(unsigned int pos, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    old_map[(pos + i) / 32] |= 1U << ((pos + i) % 32);
+  for (i = 0; i < n; i++)
+    if (!(old_map[(pos + i) / 32] & (1U << ((pos + i) % 32))))
+      {
+	sink++;
+	break;
+      }
+  for (i = 0; i < n; i++)
+    old_map[(pos + i) / 32] &= ~(1U << ((pos + i) % 32));
+}
+
+/***********************************************************************
+ *  Title: Timed runs
+ * ---------------------------------------------------------------------
+ *    Purpose: iters triples on runs of n bits, walking over every
+ *             aligned run of the bitmap
+ *    Output: nanoseconds per triple
+ ***********************************************************************/
+double
+run_new(int n, long iters)
+{
+  unsigned int pos = 0;
+  double start = now();
+  long i;
+
+  for (i = 0; i < iters; i++)
+    {
+      triple_new(pos, n);
+      pos = (pos + n) % MAPBITS;
+    }
+  return (now() - start) * 1e9 / iters;
+}
+
+double
+run_old(int n, long iters)
+{
+  unsigned int pos = 0;
+  double start = now();
+  long i;
+
+  for (i = 0; i < iters; i++)
+    {
+      triple_old(pos, n);
+      pos = (pos + n) % MAPBITS;
+    }
+  return (now() - start) * 1e9 / iters;
+}
@@ -48,6 +48,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_lock.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -57,20 +59,40 @@
  */
 #define MINPOWER 5 //2^5 = 32
 #define MINSIZE 32 //min block size
-#define HDRSIZE 9 //we need an array of size 9 to store 9 diff buffer sizes
-#define MAPSIZE (PAGESIZE/MINSIZE)/(sizeof(int)*8)
+#define HDRSIZE 8 //we need an array of size 8 to store 8 diff buffer sizes (32 - 4096)
+#define MAPBITS (PAGESIZE/MINSIZE) //number of minimum blocks in one page
+#define MAPSIZE BITMAP_WORDS(MAPBITS)
+#define MAXBLOCK (MINSIZE << (HDRSIZE - 1)) //largest block inside a page
+//every page belongs to an arena with its own free lists and locks, so
+//threads of different arenas split and merge without waiting for each
+//other. a thread allocates from its arena, a block goes back to the
+//arena of its page.
+#ifndef ARENAS
+#ifdef KMA_CONCURRENT
+#define ARENAS 4
+#else
+#define ARENAS 1
+#endif
+#endif
 
+//free blocks are linked both ways so a buddy can be unlinked in O(1)
 typedef struct blk_ptr{
   struct blk_ptr* next;
+  struct blk_ptr* prev;
 } blk_ptr_t;
 
-//2 int is sizeof(int) = 8 *4 = 32 byte
+//the kma_page_t* at the start of the page plus this header is 64 bytes
 typedef struct pg_hdr{
-  kma_page_t* this;
-  //bitmap to decide if buddy is free.
-  unsigned int bitmap[MAPSIZE];
+  //one bit per buddy pair of every order (linux free_area style).
+  //order i uses the bits from MAPBITS - (MAPBITS >> i), one per pair,
+  //the bit is one if exactly one of the two buddies is free.
+  kma_word_t bitmap[MAPSIZE];
   struct pg_hdr* prev;
   struct pg_hdr* next;
+  //number of allocated blocks in this page
+  int used;
+  //the arena whose free lists have the blocks of this page
+  int arena;
 } pg_hdr_t;
 
 //buffer list struct
@@ -79,37 +101,67 @@ typedef struct {
   blk_ptr_t* next;
 } bf_lst_t;
 
+//the free lists of an arena
+typedef struct {
+  //bit i is one if free_list[i] is not empty
+  unsigned int nonempty;
+  bf_lst_t free_list[HDRSIZE];
+} arena_t;
+
 //controller for free_list and page_list.
 typedef struct {
   int allocated;
   int freed;
-  bf_lst_t free_list[HDRSIZE];
+  arena_t arena[ARENAS];
   pg_hdr_t* page_list;
 } mem_ctrl_t;
 
 /************Global Variables*********************************************/
-static kma_page_t* entry_page = NULL;
+static KMA_LOCAL kma_page_t* entry_page = NULL;
+//one lock for every order of every arena (KMA_CONCURRENT), the last one
+//of an arena is for the spans of its threads. an operation starts with
+//the lock of its order and takes the locks of larger orders of the same
+//arena in ascending order when it splits or merges. a new page needs
+//all the orders of its arena, entry_page all the locks (arenas in
+//ascending order).
+static kma_lock_t class_lock[ARENAS][HDRSIZE + 1] =
+  { [0 ... ARENAS - 1] = { [0 ... HDRSIZE] = KMA_LOCK_INITIALIZER } };
+//page_list, taken after the class locks
+static kma_lock_t list_lock = KMA_LOCK_INITIALIZER;
+#ifdef KMA_WASTE
+static kma_waste_t waste_count;
+#endif
+#ifdef KMA_CONCURRENT
+//the arena of this thread, -1 until its first kma_malloc
+static __thread int thread_arena = -1;
+static int next_arena = 0;
+#endif
 /************Function Prototypes******************************************/
 mem_ctrl_t* pg_master();
 int next_power_of_two(int);
 void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
-void* find_fit(kma_size_t);
+void* find_fit(int, kma_size_t);
+int my_arena();
+void lock_all();
+void unlock_all();
 void init_page();
-void* get_new_free_block(kma_size_t);
+void check_init(int, int);
+void try_release_page(pg_hdr_t*, int);
+void free_all();
+void get_new_page(int);
+void release_page(pg_hdr_t*);
+void* get_span(kma_size_t);
 void add_to_free_list(void*, int);
 void delete_block(void*, int);
-void set_bit(unsigned int[], int);
-void unset_bit(unsigned int[], int);
-int get_bit(unsigned int[], int);
-int get_pos(void*);
 int get_index(int);
-void set_bitmap(void*, kma_size_t);
-void unset_bitmap(void*, kma_size_t);
+pg_hdr_t* get_pg_hdr(void*);
+arena_t* get_arena(void*);
+int toggle_pair(void*, int);
 void* find_buddy(void*, int);
-bool is_free(void*, int);
-void coalesce(void*, kma_size_t);
-void split_block(kma_size_t, int);
+int coalesce(void*, kma_size_t);
+void split_block(void*, int, int);
+void add_page(void*, int, int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -129,24 +181,81 @@ int next_power_of_two(int n) {
   return p;
 }
 //---------KMA_MALLOC-----------//
+//blocks up to MAXBLOCK come from the buddy system inside the pages,
+//larger requests get 2^k whole pages from the page buddy system (zone).
+//together they form one buddy system from 32 bytes to half the pool
+//(the entry page is always out, so the whole pool is never free).
 void* kma_malloc(kma_size_t size) {
-  if (size + sizeof(void*) > PAGESIZE)  
+  if (size + sizeof(kma_page_t*) > ((long)PAGESIZE << (MAXORDER - 1)))
     return NULL;
 
-  if (entry_page == NULL)
-    init_page();
-  if (size < MINSIZE)
-  	size = MINSIZE;
-
-  //all operations after round up size can have a benefit for not caring about the size.
-  size = next_power_of_two(size);
-
+  int ind = HDRSIZE;
+  WASTE(rounding, -size);
+  if (size <= MAXBLOCK) {
+    if (size < MINSIZE)
+    	size = MINSIZE;
+    //all operations after round up size can have a benefit for not caring about the size.
+    size = next_power_of_two(size);
+    ind = get_index(size);
+    WASTE(rounding, size);
+    WASTE(free, -size);
+  }
+  int a = my_arena();
+  kma_lock(&class_lock[a][ind]);
+  check_init(a, ind);
   mem_ctrl_t* controller = pg_master();
-  void* block = find_fit(size);
-  controller->allocated++;
+  kma_atomic_add(&controller->allocated, 1);
+  void* block;
+  if (ind == HDRSIZE)
+    block = get_span(size);
+  else
+    block = find_fit(a, size);
+  //no free span that large, the request is turned down and the pages
+  //go back if nothing else is allocated
+  int done = 0;
+  if (block == NULL) {
+    WASTE(rounding, size);
+    done = kma_atomic_add(&controller->allocated, -1) == kma_atomic_load(&controller->freed);
+  }
+  kma_unlock(&class_lock[a][ind]);
+  if (done)
+    free_all();
 
   return block;
 }
+//the arena of this thread, threads get them round robin
+int my_arena() {
+#ifdef KMA_CONCURRENT
+  if (thread_arena < 0)
+    thread_arena = (kma_atomic_add(&next_arena, 1) - 1) % ARENAS;
+  return thread_arena;
+#else
+  return 0;
+#endif
+}
+//take or release all the locks, arena by arena
+void lock_all() {
+  int a;
+  for (a = 0; a < ARENAS; a++)
+    kma_lock_range(class_lock[a], 0, HDRSIZE + 1);
+}
+void unlock_all() {
+  int a;
+  for (a = 0; a < ARENAS; a++)
+    kma_unlock_range(class_lock[a], 0, HDRSIZE + 1);
+}
+//make sure there is an entry_page, called with the lock of ind of arena a.
+//the entry_page is set up with all the locks taken.
+void check_init(int a, int ind) {
+  while (entry_page == NULL) {
+    kma_unlock(&class_lock[a][ind]);
+    lock_all();
+    if (entry_page == NULL)
+      init_page();
+    unlock_all();
+    kma_lock(&class_lock[a][ind]);
+  }
+}
 //initialize the entry_page
 void init_page() {
   kma_page_t* new_page = get_page();
@@ -156,214 +265,196 @@ void init_page() {
   mem_ctrl_t* controller = pg_master();
   
   controller->page_list = (pg_hdr_t*)((void*)controller + sizeof(mem_ctrl_t));
-  // use this to point to the kma_page_t struct for free_page()
-  controller->page_list->this = (kma_page_t*)new_page->ptr;
   controller->page_list->prev = NULL;
   controller->page_list->next = NULL;
 
-  int i;
-  for (i = 0; i < HDRSIZE; i++) {
-    controller->free_list[i].size = (1 << (i+MINPOWER));
-    controller->free_list[i].next = NULL;
+  int a, i;
+  for (a = 0; a < ARENAS; a++) {
+    for (i = 0; i < HDRSIZE; i++) {
+      controller->arena[a].free_list[i].size = (1 << (i+MINPOWER));
+      controller->arena[a].free_list[i].next = NULL;
+    }
+    controller->arena[a].nonempty = 0;
   }
+  controller->allocated = 0;
+  controller->freed = 0;
   //because we use a block in front of the entry_page
   //to store some info of the page and allocator
   //we round up the size to power of two
   //and add (2^i > pre_alloc_size) to free_list
   int pre_alloc = sizeof(kma_page_t*) + sizeof(mem_ctrl_t) + sizeof(pg_hdr_t);
+  add_page(new_page->ptr, pre_alloc, 0);
+}
+//split the page behind its header into free blocks of growing size
+//on the lists of arena a.
+//each of them has the header part as its (used) buddy, so the bit of
+//every pair is one from the beginning.
+void add_page(void* page, int pre_alloc, int a) {
+  pg_hdr_t* current = get_pg_hdr(page);
+  int i;
+  for (i = 0; i < MAPSIZE; i++) {
+  	current->bitmap[i] = 0;
+  }
+  current->used = 0;
+  current->arena = a;
   pre_alloc = next_power_of_two(pre_alloc);
-  void* start = (void*)new_page->ptr + pre_alloc;
-  void* end = (void*)new_page->ptr + PAGESIZE;
+  WASTE(header, pre_alloc);
+  WASTE(free, PAGESIZE - pre_alloc);
+  void* start = page + pre_alloc;
+  void* end = page + PAGESIZE;
   int sz = pre_alloc;
   while (start < end) {
   	add_to_free_list(start, sz);
+  	toggle_pair(start, get_index(sz));
   	start += sz;
-  	sz = sz * 2;	
-  }
-  //initialize the bitmap
-  for (i = 0; i < MAPSIZE; i++) {
-  	controller->page_list->bitmap[i] = 0;
+  	sz = sz * 2;
   }
-  int pre_alloc_pos = pre_alloc/MINSIZE;
-  for (i = 0; i < pre_alloc_pos; i++) {
-  	set_bit(controller->page_list->bitmap, i);
-  }  
-  controller->allocated = 0;
-  controller->freed = 0;
-
-}
-//i = 0: 0-31
-//i = 1: 32-63...
-//set one bit to one.
-void set_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	bitmap[i] = bitmap[i] | flag;
-}
-//set one bit to zero.
-void unset_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	flag = ~flag;
-	bitmap[i] = bitmap[i] & flag;
 }
-//get the value of one bit
-int get_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	if (bitmap[i] & flag)
-		return 1;
+//get the page header of the page ptr is in
+pg_hdr_t* get_pg_hdr(void* ptr) {
+	if (BASEADDR(ptr) == entry_page->ptr)
+		return (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
 	else
-		return 0;
+		return (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
 }
-//get the start position of ptr in the bitmap
-int get_pos(void* ptr) {
-	return (ptr - BASEADDR(ptr))/MINSIZE;
+//get the free lists of the arena of the page ptr is in
+arena_t* get_arena(void* ptr) {
+	return &pg_master()->arena[get_pg_hdr(ptr)->arena];
 }
-//set the bitmap for one blk, set all their corresponding bit to one.
-void set_bitmap(void* blk, kma_size_t size) {
-	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
-	int pos = get_pos(blk);//the start positon on the bitmap;
-	int i;
-	for (i = 0; i < size/MINSIZE; i++)
-		set_bit(current_page->bitmap, pos+i);
+//flip the bit of the buddy pair blk (of order index) belongs to.
+//return one if, after the flip, exactly one of the buddies is free.
+int toggle_pair(void* blk, int index) {
+	unsigned long offset = blk - BASEADDR(blk);
+	int pos = MAPBITS - (MAPBITS >> index) + (offset >> (index + MINPOWER + 1));
+	return bitmap_toggle(get_pg_hdr(blk)->bitmap, pos);
 }
-//unset the bitmap for one blk, set all their corresponding bit to zero.
-void unset_bitmap(void* blk, kma_size_t size) {
-	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
-	int pos = get_pos(blk);//the start positon on the bitmap;
-	int i;
-	for (i = 0; i < size/MINSIZE; i++)
-		unset_bit(current_page->bitmap, pos+i);
-}
-//get the index for each size. e.g. index(16) = 0, index(32) = 1.
+//get the index for each size. e.g. index(32) = 0, index(64) = 1.
 int get_index(int n) {
   n = next_power_of_two(n);
-  int count = 0;
-  while(n) {
-    count++;
-    n >>= 1;
-  }
-  return count - MINPOWER - 1;
+  return word_ctz(n) - MINPOWER;
 }
 //find the free block in the corresponding buffer size list of free_list.
-//if the free block not found, to request a new free block from the larger size block
-//we split the larger block into two and add them into free_list (recursively)
-//until we can find the request size block. 
+//if the free block not found, take the smallest larger block (one ctz on
+//the nonempty mask) and split it down to the request size.
 //else if there is no larger block in the free_list for this request, get a new page.
-void* find_fit(kma_size_t size) {
-  mem_ctrl_t* controller = pg_master();
+//everything happens in arena a, the new page goes to it too.
+//called with the lock of the request order, the locks up to the order we
+//split are taken on the way (the mask is only a hint for other threads).
+void* find_fit(int a, kma_size_t size) {
+  arena_t* arena = &pg_master()->arena[a];
+  kma_lock_t* locks = class_lock[a];
 
   int ind = get_index(size);
-  void* blk = NULL;
-  bf_lst_t lst = controller->free_list[ind];
-  if (lst.next) {
-    blk = (void*)lst.next;
-    //remove free block and set the corresponding bits in bitmap to one.
-    controller->free_list[ind].next = controller->free_list[ind].next->next;
-  	set_bitmap(blk, size);
+  int i = ind;
+  int all = FALSE; //TRUE once we hold all the orders of the arena
+  while (arena->free_list[i].next == NULL) {
+    unsigned int mask = WORD_LOAD(&arena->nonempty) & (~0U << (i + 1));
+    if (mask == 0 && all) {
+      get_new_page(a);
+      continue;
+    }
+    if (mask == 0) {
+      //a new page needs all the orders, let ours go first
+      kma_unlock_range(locks, ind, i + 1);
+      kma_lock_range(locks, 0, HDRSIZE);
+      all = TRUE;
+      i = ind;
+      continue;
+    }
+    int j = word_ctz(mask);
+    if (!all)
+      kma_lock_range(locks, i + 1, j + 1);
+    i = j;
   }
-  else {
-    blk = get_new_free_block(size);
+  void* blk = (void*)arena->free_list[i].next;
+  //remove free block and flip the bit of its pair
+  delete_block(blk, 1 << (i + MINPOWER));
+  toggle_pair(blk, i);
+  split_block(blk, i, ind);
+  kma_atomic_add(&get_pg_hdr(blk)->used, 1);
+  //keep only the lock of the request order
+  if (all) {
+    kma_unlock_range(locks, 0, ind);
+    i = HDRSIZE - 1;
   }
+  kma_unlock_range(locks, ind + 1, i + 1);
   return blk;
 }
-void split_block(kma_size_t size, int index) {
-	mem_ctrl_t* controller = pg_master();
-	bf_lst_t lst = controller->free_list[index];
-	blk_ptr_t* current = lst.next;
-	//larger size/2
-	int sz = (1 << (index + MINPOWER -1));
-	//remove larger one, split into small one and add to free_list.
-	controller->free_list[index].next = controller->free_list[index].next->next;
-	add_to_free_list((void*)current + sz, sz);
-	add_to_free_list((void*)current, sz);
+//split the block of order index down to order target,
+//the upper half of every split goes back to the free_list.
+void split_block(void* blk, int index, int target) {
+	while (index > target) {
+		index--;
+		//larger size/2
+		int sz = (1 << (index + MINPOWER));
+		add_to_free_list(blk + sz, sz);
+		toggle_pair(blk + sz, index);
+	}
 }
 //add block to the free_list
 void add_to_free_list(void* block, int size) {
-  mem_ctrl_t* controller = pg_master();
+  arena_t* arena = get_arena(block);
   int ind = get_index(size);
-  ((blk_ptr_t*)block)->next = controller->free_list[ind].next;
-  controller->free_list[ind].next = (blk_ptr_t*)block;
+  blk_ptr_t* blk = (blk_ptr_t*)block;
+  blk->prev = NULL;
+  blk->next = arena->free_list[ind].next;
+  if (blk->next)
+    blk->next->prev = blk;
+  arena->free_list[ind].next = blk;
+  WORD_OR(&arena->nonempty, 1U << ind);
   return;
 }
-//get a new free block
-void* get_new_free_block(kma_size_t size) {;
-  int ind = get_index(size);
+//get a new page, because it is not the enrty_page, so we can get extra space
+//for not including mem_ctrl_t structure any more.
+//so the pre_alloc_space is smaller than entry_page.
+//the page is split into free blocks of arena a, whose orders we hold.
+void get_new_page(int a) {
   mem_ctrl_t* controller = pg_master();
 
-  int i;
-  //check the larger size buffer list, not include 8192
-  for (i = ind + 1; i < HDRSIZE - 1; i++) {
-  	bf_lst_t lst = controller->free_list[i];
-  	if (lst.next) {
-  		//split block and re-search the free_list
-			split_block(size, i);
-			return find_fit(size); 
-   	}
-  }
-  //get a new page, because it is not the enrty_page, so we can get extra space
-  //for not including mem_ctrl_t structure any more.
-  //so the pre_alloc_space is smaller than entry_page
+  kma_lock(&list_lock);
   kma_page_t* new_page = get_page();
   *((kma_page_t**)new_page->ptr) = new_page;
   pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
-  current->this = (kma_page_t*)(new_page->ptr);
-  current->next = NULL;
-  //add this page to page_list
-  pg_hdr_t* previous = controller->page_list;
-  while (previous) {
-    if (previous->next == NULL) {
-      current->prev = previous;
-      previous->next = current;
-      break;
-    }
-    else
-      previous = previous->next;
-  }
+  //add this page to page_list, just behind the entry_page
+  pg_hdr_t* head = controller->page_list;
+  current->prev = head;
+  current->next = head->next;
+  if (head->next)
+    head->next->prev = current;
+  head->next = current;
+  kma_unlock(&list_lock);
 
-  if (size > 4096) {
-  	// if size > 4096, just return this page to the request
-    return (void*)((void*)current + sizeof(pg_hdr_t));
-  }
-  else {
-  	int pre_alloc = sizeof(kma_page_t*) + sizeof(pg_hdr_t);
-	  pre_alloc = next_power_of_two(pre_alloc);
-	  void* start = (void*)new_page->ptr + pre_alloc;
-	  void* end = (void*)new_page->ptr + PAGESIZE;
-	  int sz = pre_alloc;
-	  while (start < end) {
-	  	add_to_free_list(start, sz);
-	  	start += sz;
-	  	sz = sz * 2;  	
-	  }
-	  //init bitmap
-	  int pre_alloc_pos = pre_alloc/MINSIZE;
-	  for (i = 0; i < MAPSIZE; i++) {
-	  	current->bitmap[i] = 0;
-	  }
-	  //set bitmap
-	  for (i = 0; i < pre_alloc_pos; i++) {
-	  	set_bit(current->bitmap, i);
-	  }
-	  return find_fit(size); 
-  }
+  add_page(new_page->ptr, sizeof(kma_page_t*) + sizeof(pg_hdr_t), a);
+}
+//give an empty page back to the page buddy system.
+//all its blocks are free, so they are merged back into
+//the blocks add_page made, we take them off the free_list.
+void release_page(pg_hdr_t* current) {
+  void* page = BASEADDR(current);
+  int sz = next_power_of_two(sizeof(kma_page_t*) + sizeof(pg_hdr_t));
+  WASTE(header, -sz);
+  WASTE(free, sz - PAGESIZE);
+  for (; sz <= MAXBLOCK; sz *= 2)
+    delete_block(page + sz, sz);
+  kma_lock(&list_lock);
+  current->prev->next = current->next;
+  if (current->next)
+    current->next->prev = current->prev;
+  free_page(*(kma_page_t**)page);
+  kma_unlock(&list_lock);
+}
+//requests larger than MAXBLOCK get 2^k contiguous pages,
+//with the kma_page_t* in front like the dummy allocator.
+//NULL if the zone has no free block of that order.
+void* get_span(kma_size_t size) {
+  int pages = (size + sizeof(kma_page_t*) + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* span = get_pages(word_ctz(next_power_of_two(pages)));
+  if (span == NULL)
+    return NULL;
+  *((kma_page_t**)span->ptr) = span;
+  WASTE(rounding, span->size - sizeof(kma_page_t*));
+  WASTE(header, sizeof(kma_page_t*));
+  return span->ptr + sizeof(kma_page_t*);
 }
 //find buddy of request block, return the buddy address
 void* find_buddy(void* ptr, int size) {
@@ -373,97 +464,141 @@ void* find_buddy(void* ptr, int size) {
 	return (void*)(BASEADDR(ptr) + bud);
 
 }
-//check if the corresponding bits of request block in bitmap are all zero.
-//if all zeros, return true, means this block is globaly free.
-//else this block is locally free(for lzbud) 
-bool is_free(void* ptr, int size) {
-	pg_hdr_t* current_page;
-	if (BASEADDR(ptr) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
-	int offset = (ptr-BASEADDR(ptr))/MINSIZE;
-	int i;
-	int flag;
-	for (i = 0; i < size/MINSIZE; i++) {
-		flag = get_bit(current_page->bitmap, offset+i);
-		if (flag != 0) 
-			return FALSE;
-	}
-	return TRUE;
-}
 //use to delete block in the free_list.
-//when you coalesce two block, you need to delete two blocks
+//when you coalesce two block, you need to delete the buddy
 //after that, add one larger to the free_list
 //no need to set or unset bitmap
 void delete_block(void* ptr, int size) {
-	mem_ctrl_t* controller = pg_master();
+	arena_t* arena = get_arena(ptr);
 	int i = get_index(size);
-	bf_lst_t lst = controller->free_list[i];
-	blk_ptr_t* cur = lst.next;
-	blk_ptr_t* prev;
-	if (cur == NULL)
-		return;
-	if (cur == ptr) {
-		controller->free_list[i].next = controller->free_list[i].next->next;
-		cur->next = NULL;
-		return;
-	}
-	else {
-		prev = cur;
-		cur = cur->next;
-		while(cur != NULL) {
-			if (cur == ptr) {
-				prev->next = cur->next;
-				cur->next = NULL;
-				return;
-			}
-			prev = cur;
-			cur = cur->next;
-		}
-	} 
+	blk_ptr_t* blk = (blk_ptr_t*)ptr;
+	if (blk->prev)
+		blk->prev->next = blk->next;
+	else
+		arena->free_list[i].next = blk->next;
+	if (blk->next)
+		blk->next->prev = blk->prev;
+	if (arena->free_list[i].next == NULL)
+		WORD_AND(&arena->nonempty, ~(1U << i));
+	blk->next = NULL;
+	blk->prev = NULL;
 }
-//coalesce buddy blocks recursively
-void coalesce(void* ptr, kma_size_t size) {
-	void* bud = find_buddy(ptr, size);
-	if (is_free(bud, size)) {
-		delete_block(ptr, size);
+//coalesce buddy blocks, ptr is not on the free_list yet.
+//flipping the pair bit tells if the buddy is free: if the bit drops to
+//zero both halves are free, so we unlink the buddy and go one order up.
+//the header blocks keep the page from merging past MAXBLOCK, an empty
+//page goes back to the page buddy system instead.
+//called with the lock of size of the arena of the page, the lock of the
+//next order is taken before the one of this order goes. returns the order
+//the block ends up in, whose lock we still hold.
+int coalesce(void* ptr, kma_size_t size) {
+	kma_lock_t* locks = class_lock[get_pg_hdr(ptr)->arena];
+	int i = get_index(size);
+	while (toggle_pair(ptr, i) == 0) {
+		void* bud = find_buddy(ptr, size);
 		delete_block(bud, size);
-		void* new_blk;
-		if (ptr < bud)
-			new_blk = ptr;
-		else
-			new_blk = bud;
-		int new_size = 2 * size;
-		if (new_size > 4096)
-			return;
-		add_to_free_list(new_blk, new_size);
-		coalesce(new_blk, new_size);
+		kma_lock(&locks[i + 1]);
+		kma_unlock(&locks[i]);
+		if (bud < ptr)
+			ptr = bud;
+		size = 2 * size;
+		i++;
+	}
+	add_to_free_list(ptr, size);
+	pg_hdr_t* current = get_pg_hdr(ptr);
+	if (kma_atomic_add(&current->used, -1) == 0 && BASEADDR(ptr) != entry_page->ptr)
+		try_release_page(current, i);
+	return i;
+}
+//an empty page has its blocks on the lists of the orders from its first
+//block up to MAXBLOCK, we need their locks to take them off. we hold the
+//lock of held and must not wait for the others, if one is taken the page
+//stays (it is used again or freed in free_all).
+void try_release_page(pg_hdr_t* current, int held) {
+	kma_lock_t* locks = class_lock[current->arena];
+	int first = get_index(sizeof(kma_page_t*) + sizeof(pg_hdr_t));
+	int i;
+	for (i = first; i < HDRSIZE; i++) {
+		if (i != held && !kma_trylock(&locks[i]))
+			break;
+	}
+	//no block of the page can be taken while we hold these locks
+	if (i == HDRSIZE && kma_atomic_load(&current->used) == 0)
+		release_page(current);
+	while (i-- > first) {
+		if (i != held)
+			kma_unlock(&locks[i]);
 	}
 }
 void kma_free(void* ptr, kma_size_t size)
 { 
+	WASTE(rounding, size);
 	if (size < MINSIZE) 
 		size = MINSIZE;
 	size = next_power_of_two(size);
-  add_to_free_list(ptr, size);
-  //unset of set bitmap after kma_free or kma_malloc 
-  unset_bitmap(ptr, size);
-  coalesce(ptr, size);
+	int a, ind;
+  //spans go straight back to the page buddy system,
+  //where they merge with their free neighbours
+  if (size > MAXBLOCK) {
+    a = my_arena();
+    ind = HDRSIZE;
+    kma_lock(&class_lock[a][ind]);
+    kma_page_t* span = *(kma_page_t**)BASEADDR(ptr);
+    WASTE(rounding, sizeof(kma_page_t*) - span->size);
+    WASTE(header, -(long) sizeof(kma_page_t*));
+    free_page(span);
+  }
+  else {
+    WASTE(rounding, -size);
+    WASTE(free, size);
+    a = get_pg_hdr(ptr)->arena;
+    kma_lock(&class_lock[a][get_index(size)]);
+    ind = coalesce(ptr, size);
+  }
   mem_ctrl_t* controller = pg_master();
-  controller->freed++;
-  //if free operations and alloc operations are the same amounts
-  //free all pages
-  if (controller->freed == controller->allocated){
+  int done = kma_atomic_add(&controller->freed, 1) == kma_atomic_load(&controller->allocated);
+  kma_unlock(&class_lock[a][ind]);
+  if (done)
+    free_all();
+  return;
+}
+//if free operations and alloc operations are the same amounts
+//free all pages.
+//with all the locks taken no other thread is in the middle of
+//kma_malloc or kma_free, so we check again.
+void free_all() {
+  lock_all();
+  mem_ctrl_t* controller = entry_page ? pg_master() : NULL;
+  if (controller && controller->freed == controller->allocated){
     pg_hdr_t* current_page = controller->page_list;
   	while (current_page) {
-    	kma_page_t* page = *(kma_page_t**)current_page->this;
+    	kma_page_t* page = *(kma_page_t**)BASEADDR(current_page);
     	current_page = current_page->next;
     	free_page(page);
   	}
   	entry_page = NULL;
+  	WASTE_RESET();
   }
-  return;
+  unlock_all();
+}
+
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste) {
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//the roots of the heap of this thread go to another one
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = entry_page;
+  heap->count = 0;
+  entry_page = NULL;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+  entry_page = heap->root;
 }
+#endif
 
 #endif // KMA_BUD
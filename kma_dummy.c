@@ -61,6 +61,10 @@
 
 /************Global Variables*********************************************/
 
+#ifdef KMA_WASTE
+static kma_waste_t waste_count;
+#endif
+
 /************Function Prototypes******************************************/
 
 /************External Declaration*****************************************/
@@ -90,6 +94,9 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
+  // the rest of the page is rounding
+  WASTE(header, sizeof(kma_page_t*));
+  WASTE(rounding, page->size - sizeof(kma_page_t*) - size);
   return page->ptr + sizeof(kma_page_t*);
 }
 
@@ -99,7 +106,27 @@ void kma_free(void* ptr, kma_size_t size)
   
   page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
   
+  WASTE(header, -(long) sizeof(kma_page_t*));
+  WASTE(rounding, size + (long) sizeof(kma_page_t*) - page->size);
   free_page(page);
 }
 
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste)
+{
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//every block has its own page, a heap has no roots to move
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = NULL;
+  heap->count = 0;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+}
+#endif
+
 #endif // KMA_DUMMY
@@ -0,0 +1,496 @@
+/***************************************************************************
+ *  Title: Trace Generator
+ * -------------------------------------------------------------------------
+ *    Purpose: Generates traces of millions of operations, in the text
+ *             format and the binary format of kma_trace.h. Request
+ *             sizes come from a size model, and every request is freed
+ *             after a lifetime (counted in allocations) from a lifetime
+ *             model. Pending frees wait in a heap ordered by the
+ *             allocation they die at, so a trace takes O(n log n).
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+enum SIZE_MODEL
+  {
+    S_LOG,      // log:min:max, uniform in log space like generate_trace
+    S_LINEAR,   // linear:min:max
+    S_BIMODAL,  // bimodal:small:large:p, p of the requests near small
+    S_ZIPF,     // zipf:min:max:s, size min + k - 1 has weight 1/k^s
+    S_FILE      // file:name, lines of "size weight"
+  };
+
+enum LIFE_MODEL
+  {
+    L_UNIFORM,  // uniform:max
+    L_EXP,      // exp:mean
+    L_PHASE,    // phase:length:p, all die at the end of their phase, p
+                // of them at the end of the next one
+    L_GEN       // gen:young:old:p, p of them exp:young, the rest exp:old
+  };
+
+// a free that waits for the allocation it happens at
+typedef struct
+{
+  long death;
+  int id;
+} pending_t;
+
+/************Global Variables*********************************************/
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static enum SIZE_MODEL size_model;
+static double size_arg[3];
+// the sizes and their cumulative weights of zipf and file
+static int* cdf_size = NULL;
+static double* cdf_weight = NULL;
+static int cdf_n = 0;
+
+static enum LIFE_MODEL life_model;
+static double life_arg[3];
+
+// frees by the allocation they happen at, a binary heap
+static pending_t* heap = NULL;
+static int heap_n = 0;
+
+// the trace, grown as it is generated
+static kma_trace_op_t* ops = NULL;
+static long n_ops = 0, max_ops = 0;
+
+// ids of freed requests that can be used again with -r
+static int* free_ids = NULL;
+static int n_free_ids = 0;
+
+/************Function Prototypes******************************************/
+double uniform();
+int next_size();
+long next_life(long);
+void parse_size(char*);
+void parse_life(char*);
+void read_histogram(char*);
+void heap_push(long, int);
+pending_t heap_pop();
+void emit(int, int, int);
+void write_text(char*, int);
+void write_binary(char*, int);
+void usage(char*);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  char* text = NULL;
+  char* binary = NULL;
+  int opt, recycle = 0;
+  long i, count;
+
+  while ((opt = getopt(argc, argv, "S:rt:b:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'S':
+	  rng = strtoull(optarg, NULL, 10) * 2685821657736338717ULL + 1;
+	  break;
+	case 'r':
+	  recycle = 1;
+	  break;
+	case 't':
+	  text = optarg;
+	  break;
+	case 'b':
+	  binary = optarg;
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+  // with neither -t nor -b the trace is only generated, for timing
+  if (argc - optind != 3)
+    usage(argv[0]);
+  count = atol(argv[optind]);
+  if (count < 1 || count > 0x7fffffff)
+    error("bad number of allocations", argv[optind]);
+  parse_size(argv[optind + 1]);
+  parse_life(argv[optind + 2]);
+
+  double start = (double) clock() / CLOCKS_PER_SEC;
+  long bytes = 0, max_bytes = 0;
+  int next_id = 0, max_live = 0;
+  int* size_of = malloc(sizeof(int) * count);
+
+  heap = malloc(sizeof(pending_t) * (count + 1));
+  if (recycle)
+    free_ids = malloc(sizeof(int) * count);
+
+  for (i = 0; i < count; i++)
+    {
+      // the frees that are due first
+      while (heap_n > 0 && heap[0].death <= i)
+	{
+	  pending_t p = heap_pop();
+
+	  bytes -= size_of[p.id];
+	  emit(TRACE_FREE, p.id, 0);
+	  if (recycle)
+	    free_ids[n_free_ids++] = p.id;
+	}
+
+      int id = recycle && n_free_ids > 0 ? free_ids[--n_free_ids] :
+	next_id++;
+      int size = next_size();
+
+      size_of[id] = size;
+      heap_push(next_life(i), id);
+      emit(TRACE_REQUEST, id, size);
+      bytes += size;
+      if (bytes > max_bytes)
+	max_bytes = bytes;
+      if (heap_n > max_live)
+	max_live = heap_n;
+    }
+  while (heap_n > 0)
+    {
+      pending_t p = heap_pop();
+
+      emit(TRACE_FREE, p.id, 0);
+    }
+
+  double elapsed = (double) clock() / CLOCKS_PER_SEC - start;
+
+  // n_req is the size of the requests table of the harness
+  if (text)
+    write_text(text, next_id);
+  if (binary)
+    write_binary(binary, next_id);
+
+  printf("%ld allocations, %ld deallocations, %d request ids\n", count,
+	 n_ops - count, next_id);
+  printf("Maximum bytes allocated: %ld, maximum live requests: %d\n",
+	 max_bytes, max_live);
+  printf("Generated %ld operations in %.3f s (%.1f M/s)\n", n_ops, elapsed,
+	 elapsed > 0 ? n_ops / elapsed / 1e6 : 0.0);
+  return 0;
+}
+
+// xorshift64*, uniform in [0, 1)
+double
+uniform()
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the index of the first cumulative weight above u * total
+static int
+cdf_pick()
+{
+  double u = uniform() * cdf_weight[cdf_n - 1];
+  int lo = 0, hi = cdf_n - 1;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (cdf_weight[mid] > u)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  return lo;
+}
+
+int
+next_size()
+{
+  double v = 0;
+
+  switch (size_model)
+    {
+    case S_LOG:
+      v = pow(2.0, uniform() * (log2(size_arg[1]) - log2(size_arg[0])) +
+	      log2(size_arg[0]));
+      break;
+    case S_LINEAR:
+      v = uniform() * (size_arg[1] - size_arg[0]) + size_arg[0];
+      break;
+    case S_BIMODAL:
+      // within a quarter of the mode
+      v = uniform() < size_arg[2] ? size_arg[0] : size_arg[1];
+      v *= 0.75 + 0.5 * uniform();
+      break;
+    case S_ZIPF:
+    case S_FILE:
+      return cdf_size[cdf_pick()];
+    }
+  return v < 1 ? 1 : (int) v;
+}
+
+// the allocation a request made at allocation i is freed at
+long
+next_life(long i)
+{
+  long phase;
+
+  switch (life_model)
+    {
+    case L_UNIFORM:
+      return i + 1 + (long) (uniform() * life_arg[0]);
+    case L_EXP:
+      return i + 1 + (long) (-log(1.0 - uniform()) * life_arg[0]);
+    case L_PHASE:
+      phase = (long) life_arg[0];
+      return (i / phase + (uniform() < life_arg[1] ? 2 : 1)) * phase;
+    case L_GEN:
+      return i + 1 + (long) (-log(1.0 - uniform()) *
+			     (uniform() < life_arg[2] ? life_arg[0] :
+			      life_arg[1]));
+    }
+  return i + 1;
+}
+
+// read a model name and up to three numbers after it
+static int
+parse_model(char* spec, char* name, int n, double arg[])
+{
+  int len = strlen(name), i;
+  char* p = spec + len;
+
+  if (strncmp(spec, name, len) != 0 || (*p != ':' && *p != '\0'))
+    return 0;
+  for (i = 0; i < n; i++)
+    {
+      if (*p != ':')
+	error("not enough numbers in model", spec);
+      arg[i] = strtod(p + 1, &p);
+    }
+  if (*p != '\0')
+    error("too many numbers in model", spec);
+  return 1;
+}
+
+void
+parse_size(char* spec)
+{
+  int k;
+
+  if (strncmp(spec, "file:", 5) == 0)
+    {
+      size_model = S_FILE;
+      read_histogram(spec + 5);
+    }
+  else if (parse_model(spec, "log", 2, size_arg))
+    size_model = S_LOG;
+  else if (parse_model(spec, "linear", 2, size_arg))
+    size_model = S_LINEAR;
+  else if (parse_model(spec, "bimodal", 3, size_arg))
+    size_model = S_BIMODAL;
+  else if (parse_model(spec, "zipf", 3, size_arg))
+    {
+      size_model = S_ZIPF;
+      cdf_n = (int) (size_arg[1] - size_arg[0]) + 1;
+      if (cdf_n < 1)
+	error("empty size range", spec);
+      cdf_size = malloc(sizeof(int) * cdf_n);
+      cdf_weight = malloc(sizeof(double) * cdf_n);
+      for (k = 0; k < cdf_n; k++)
+	{
+	  cdf_size[k] = (int) size_arg[0] + k;
+	  cdf_weight[k] = (k ? cdf_weight[k - 1] : 0) +
+	    1.0 / pow(k + 1, size_arg[2]);
+	}
+    }
+  else
+    error("unknown size model", spec);
+  if (size_model != S_FILE && size_model != S_ZIPF &&
+      (size_arg[0] < 1 || size_arg[1] < size_arg[0]))
+    error("bad size range", spec);
+}
+
+void
+parse_life(char* spec)
+{
+  if (parse_model(spec, "uniform", 1, life_arg))
+    life_model = L_UNIFORM;
+  else if (parse_model(spec, "exp", 1, life_arg))
+    life_model = L_EXP;
+  else if (parse_model(spec, "phase", 2, life_arg))
+    {
+      life_model = L_PHASE;
+      if (life_arg[0] < 1)
+	error("bad phase length", spec);
+    }
+  else if (parse_model(spec, "gen", 3, life_arg))
+    life_model = L_GEN;
+  else
+    error("unknown lifetime model", spec);
+}
+
+// an empirical size distribution, one "size weight" per line
+void
+read_histogram(char* file)
+{
+  FILE* f = fopen(file, "r");
+  int size, max = 0;
+  double weight;
+
+  if (f == NULL)
+    error("unable to open histogram file", file);
+  while (fscanf(f, "%d %lf", &size, &weight) == 2)
+    {
+      if (size < 1 || weight < 0)
+	error("bad line in histogram file", file);
+      if (cdf_n == max)
+	{
+	  max = max ? 2 * max : 64;
+	  cdf_size = realloc(cdf_size, sizeof(int) * max);
+	  cdf_weight = realloc(cdf_weight, sizeof(double) * max);
+	}
+      cdf_size[cdf_n] = size;
+      cdf_weight[cdf_n] = (cdf_n ? cdf_weight[cdf_n - 1] : 0) + weight;
+      cdf_n++;
+    }
+  fclose(f);
+  if (cdf_n == 0 || cdf_weight[cdf_n - 1] <= 0)
+    error("no sizes in histogram file", file);
+}
+
+void
+heap_push(long death, int id)
+{
+  int i = heap_n++;
+
+  while (i > 0 && heap[(i - 1) / 2].death > death)
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  heap[i].death = death;
+  heap[i].id = id;
+}
+
+pending_t
+heap_pop()
+{
+  pending_t top = heap[0], last = heap[--heap_n];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < heap_n)
+    {
+      if (child + 1 < heap_n && heap[child + 1].death < heap[child].death)
+	child++;
+      if (heap[child].death >= last.death)
+	break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  heap[i] = last;
+  return top;
+}
+
+void
+emit(int op, int id, int size)
+{
+  if (n_ops == max_ops)
+    {
+      max_ops = max_ops ? 2 * max_ops : 1 << 20;
+      ops = realloc(ops, sizeof(kma_trace_op_t) * max_ops);
+      if (ops == NULL)
+	error("out of memory for", "the trace");
+    }
+  ops[n_ops].op = op;
+  ops[n_ops].id = id;
+  ops[n_ops].size = size;
+  n_ops++;
+}
+
+void
+write_text(char* file, int n_req)
+{
+  FILE* f = fopen(file, "w");
+  static char buf[1 << 16];
+  long i;
+
+  if (f == NULL)
+    error("unable to open output file", file);
+  setvbuf(f, buf, _IOFBF, sizeof(buf));
+  fprintf(f, "%d\n", n_req);
+  for (i = 0; i < n_ops; i++)
+    {
+      if (ops[i].op == TRACE_REQUEST)
+	fprintf(f, "REQUEST %d %d\n", ops[i].id, ops[i].size);
+      else
+	fprintf(f, "FREE %d\n", ops[i].id);
+    }
+  if (fclose(f) != 0)
+    error("unable to write", file);
+}
+
+void
+write_binary(char* file, int n_req)
+{
+  FILE* f = fopen(file, "w");
+  kma_trace_header_t header;
+
+  if (f == NULL)
+    error("unable to open output file", file);
+  if (n_ops > 0x7fffffff)
+    error("too many operations for a binary trace", file);
+  memcpy(header.magic, KMA_TRACE_MAGIC, sizeof(header.magic));
+  header.n_req = n_req;
+  header.n_ops = n_ops;
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(ops, sizeof(kma_trace_op_t), n_ops, f) != n_ops ||
+      fclose(f) != 0)
+    error("unable to write", file);
+}
+
+void
+usage(char* name)
+{
+  printf("Usage: %s [-S seed] [-r] [-t textFile] [-b binaryFile] "
+	 "allocations sizeModel lifetimeModel\n", name);
+  printf("  sizes: log:min:max linear:min:max bimodal:small:large:p\n");
+  printf("         zipf:min:max:s file:histogram (lines of size weight)\n");
+  printf("  lifetimes (in allocations): uniform:max exp:mean\n");
+  printf("         phase:length:p gen:young:old:p\n");
+  printf("  -r uses the ids of freed requests again, so the live set\n");
+  printf("     stays the same size however many allocations there are\n");
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
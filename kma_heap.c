@@ -0,0 +1,120 @@
+/***************************************************************************
+ *  Title: Per-thread Heaps
+ * -------------------------------------------------------------------------
+ *    Purpose: A private heap of any of the allocators for every thread
+ *             (KMA_HEAP). The allocator is built as the single threaded
+ *             one with its roots in thread-local variables (see kma.h),
+ *             so a heap takes no locks at all. The heaps get their pages
+ *             from kma_page.c, which is shared and caches pages per CPU.
+ *             A thread that exits with blocks left leaves its heap to
+ *             the next thread that starts, an empty heap has given its
+ *             pages back already
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifdef KMA_HEAP
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_lock.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+#define ORPHANS 128 //heaps of exited threads waiting for a new thread
+
+/************Global Variables*********************************************/
+//TRUE once this thread has a heap
+static __thread bool registered = FALSE;
+//heaps with blocks left by threads that exited
+static kma_heap_t orphan[ORPHANS];
+static int n_orphans = 0;
+static long orphaned = 0;
+static long adopted = 0;
+static kma_lock_t orphan_lock = KMA_LOCK_INITIALIZER;
+#ifdef KMA_CONCURRENT
+//a thread that exits leaves its heap
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+#endif
+/************Function Prototypes******************************************/
+void heap_register();
+#ifdef KMA_CONCURRENT
+void heap_make_key();
+#endif
+void heap_exit(void*);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+void* kma_malloc(kma_size_t size) {
+  if (!registered)
+    heap_register();
+  return kma_backend_malloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size) {
+  kma_backend_free(ptr, size);
+}
+
+#ifdef KMA_CONCURRENT
+void heap_make_key() {
+  pthread_key_create(&exit_key, heap_exit);
+}
+#endif
+//the first kma_malloc of a thread adopts a heap left by another
+//thread if there is one, the key makes sure heap_exit runs
+void heap_register() {
+#ifdef KMA_CONCURRENT
+  pthread_once(&exit_once, heap_make_key);
+  pthread_setspecific(exit_key, &registered);
+#endif
+  registered = TRUE;
+  kma_lock(&orphan_lock);
+  if (n_orphans > 0) {
+    kma_heap_load(&orphan[--n_orphans]);
+    adopted++;
+  }
+  kma_unlock(&orphan_lock);
+}
+//a heap with blocks left waits for a new thread
+void heap_exit(void* arg) {
+  kma_heap_t heap;
+
+  kma_heap_save(&heap);
+  registered = FALSE;
+  if (heap.root == NULL)
+    return;
+  kma_lock(&orphan_lock);
+  if (n_orphans == ORPHANS)
+    error("too many heaps left by exited threads", "");
+  orphan[n_orphans++] = heap;
+  orphaned++;
+  kma_unlock(&orphan_lock);
+}
+
+void kma_heap_stats(long* left, long* taken) {
+  kma_lock(&orphan_lock);
+  *left = orphaned;
+  *taken = adopted;
+  kma_unlock(&orphan_lock);
+}
+
+#endif // KMA_HEAP
@@ -0,0 +1,313 @@
+/***************************************************************************
+ *  Title: Latency Histograms
+ * -------------------------------------------------------------------------
+ *    Purpose: A cheap timer and log-bucketed histograms of the time of
+ *             kma_malloc and kma_free calls (KMA_LATENCY), by operation
+ *             and size class, with percentiles as text and JSON
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_LATENCY_H__
+#define __KMA_LATENCY_H__
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// a value v >= LAT_SUB falls into one of LAT_SUB buckets between its
+// highest power of two and the next one, so a bucket is at most 1/16
+// (6%) wide. Values below LAT_SUB have a bucket each.
+#define LAT_SUBBITS 4
+#define LAT_SUB (1 << LAT_SUBBITS)
+#define LAT_BUCKETS ((64 - LAT_SUBBITS + 1) * LAT_SUB)
+
+// kma_malloc and kma_free
+#define LAT_OPS 2
+#define LAT_MALLOC 0
+#define LAT_FREE 1
+
+// requests up to 16 bytes, 17 to 32, ... 4097 to 8192, and more than
+// a page. The last histogram of an op is all of its sizes.
+#define LAT_CLASSES 11
+#define LAT_ALL LAT_CLASSES
+
+typedef unsigned long long kma_tick_t;
+
+typedef struct
+{
+  long count;
+  kma_tick_t total;
+  kma_tick_t max;
+  long bucket[LAT_BUCKETS];
+} kma_hist_t;
+
+/************Global Variables*********************************************/
+
+static kma_hist_t lat_hist[LAT_OPS][LAT_CLASSES + 1];
+
+// the ticks two back to back timer reads take, and ticks per ns
+static kma_tick_t lat_overhead = 0;
+static double lat_ticks_per_ns = 1.0;
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Timer
+ * ---------------------------------------------------------------------
+ *    Purpose: Read the time stamp counter (rdtsc) where there is one,
+ *             the monotonic clock in ns elsewhere
+ ***********************************************************************/
+static inline kma_tick_t
+lat_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline double
+lat_clock_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/***********************************************************************
+ *  Title: Timer calibration
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the ticks per ns of the timer (10 ms against the
+ *             monotonic clock) and the overhead of a measurement, the
+ *             fastest of many empty ones. The overhead is subtracted
+ *             from every call that is recorded.
+ ***********************************************************************/
+static void
+lat_init()
+{
+  kma_tick_t t0, t1;
+  double start, end;
+  int i;
+
+  start = lat_clock_ns();
+  t0 = lat_now();
+  do
+    end = lat_clock_ns();
+  while (end - start < 1e7);
+  t1 = lat_now();
+  lat_ticks_per_ns = (t1 - t0) / (end - start);
+
+  lat_overhead = ~0ULL;
+  for (i = 0; i < 10000; i++)
+    {
+      t0 = lat_now();
+      t1 = lat_now();
+      if (t1 - t0 < lat_overhead)
+	lat_overhead = t1 - t0;
+    }
+  memset(lat_hist, 0, sizeof(lat_hist));
+}
+
+/***********************************************************************
+ *  Title: Buckets
+ * ---------------------------------------------------------------------
+ *    Purpose: The bucket of a value, the highest value of a bucket,
+ *             and the size class of a request
+ ***********************************************************************/
+static inline int
+lat_bucket(kma_tick_t v)
+{
+  int shift;
+
+  if (v < LAT_SUB)
+    return v;
+  shift = 63 - __builtin_clzll(v) - LAT_SUBBITS;
+  return (shift + 1) * LAT_SUB + (int) (v >> shift) - LAT_SUB;
+}
+
+static inline kma_tick_t
+lat_bucket_high(int b)
+{
+  int shift = b / LAT_SUB - 1;
+
+  if (b < LAT_SUB)
+    return b;
+  return ((kma_tick_t) (LAT_SUB + b % LAT_SUB + 1) << shift) - 1;
+}
+
+static inline int
+lat_class(int size)
+{
+  int c = 0;
+
+  if (size > PAGESIZE)
+    return LAT_CLASSES - 1;
+  while ((16 << c) < size)
+    c++;
+  return c;
+}
+
+/***********************************************************************
+ *  Title: Record a call
+ * ---------------------------------------------------------------------
+ *    Purpose: Add the time of a call that started at start, less the
+ *             overhead of the timer, to the histogram of its op and size
+ ***********************************************************************/
+static inline void
+lat_record(int op, int size, kma_tick_t start)
+{
+  kma_tick_t v = lat_now() - start;
+  kma_hist_t* h = &lat_hist[op][lat_class(size)];
+
+  v = v > lat_overhead ? v - lat_overhead : 0;
+  h->count++;
+  h->total += v;
+  if (v > h->max)
+    h->max = v;
+  h->bucket[lat_bucket(v)]++;
+}
+
+/***********************************************************************
+ *  Title: Percentiles
+ * ---------------------------------------------------------------------
+ *    Purpose: The value at or below which p percent of the calls of a
+ *             histogram were, in ns (the highest value of its bucket,
+ *             never more than the largest call)
+ ***********************************************************************/
+static double
+lat_percentile(kma_hist_t* h, double p)
+{
+  long rank = (long) (p / 100.0 * h->count + 0.999999), seen = 0;
+  kma_tick_t v = 0;
+  int b;
+
+  if (rank < 1)
+    rank = 1;
+  for (b = 0; b < LAT_BUCKETS; b++)
+    {
+      seen += h->bucket[b];
+      if (seen >= rank)
+	{
+	  v = lat_bucket_high(b);
+	  break;
+	}
+    }
+  if (v > h->max)
+    v = h->max;
+  return v / lat_ticks_per_ns;
+}
+
+/***********************************************************************
+ *  Title: Report
+ * ---------------------------------------------------------------------
+ *    Purpose: Sum the classes of every op into its last histogram,
+ *             print p50, p90, p99, p99.9 and max of every histogram
+ *             with calls, and write the same as JSON to file. A class
+ *             is named by its largest request.
+ ***********************************************************************/
+static void
+lat_report(char* file)
+{
+  static char* op_name[LAT_OPS] = { "malloc", "free" };
+  static double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+  FILE* json = fopen(file, "w");
+  char label[16];
+  int op, c, b, i, n, first = 1;
+
+  printf("Latency in ns (timer overhead of %.1f ns subtracted):\n",
+	 lat_overhead / lat_ticks_per_ns);
+  printf("%-7s %-7s %9s %8s %8s %8s %8s %8s %9s\n", "op", "size", "calls",
+	 "mean", "p50", "p90", "p99", "p99.9", "max");
+  if (json)
+    fprintf(json, "{\n  \"timer\": \"%s\",\n  \"overhead_ns\": %.1f,\n"
+	    "  \"histograms\": [",
+#if defined(__x86_64__) || defined(__i386__)
+	    "rdtsc",
+#else
+	    "clock_gettime",
+#endif
+	    lat_overhead / lat_ticks_per_ns);
+
+  for (op = 0; op < LAT_OPS; op++)
+    {
+      kma_hist_t* all = &lat_hist[op][LAT_ALL];
+
+      memset(all, 0, sizeof(kma_hist_t));
+      for (c = 0; c < LAT_CLASSES; c++)
+	{
+	  kma_hist_t* h = &lat_hist[op][c];
+
+	  all->count += h->count;
+	  all->total += h->total;
+	  if (h->max > all->max)
+	    all->max = h->max;
+	  for (b = 0; b < LAT_BUCKETS; b++)
+	    all->bucket[b] += h->bucket[b];
+	}
+
+      // all sizes first, then the classes from small to large
+      for (n = 0; n <= LAT_CLASSES; n++)
+	{
+	  c = n == 0 ? LAT_ALL : n - 1;
+	  kma_hist_t* h = &lat_hist[op][c];
+	  double p[4];
+
+	  if (h->count == 0)
+	    continue;
+	  if (c == LAT_ALL)
+	    strcpy(label, "all");
+	  else if (c == LAT_CLASSES - 1)
+	    strcpy(label, "pages");
+	  else
+	    sprintf(label, "%d", 16 << c);
+	  for (i = 0; i < 4; i++)
+	    p[i] = lat_percentile(h, pct[i]);
+
+	  printf("%-7s %-7s %9ld %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f\n",
+		 op_name[op], label, h->count,
+		 h->total / lat_ticks_per_ns / h->count, p[0], p[1], p[2],
+		 p[3], h->max / lat_ticks_per_ns);
+	  if (json)
+	    fprintf(json, "%s\n    {\"op\": \"%s\", \"size\": \"%s\", "
+		    "\"calls\": %ld, \"mean\": %.1f, \"p50\": %.1f, "
+		    "\"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, "
+		    "\"max\": %.1f}",
+		    first ? "" : ",", op_name[op], label, h->count,
+		    h->total / lat_ticks_per_ns / h->count, p[0], p[1], p[2],
+		    p[3], h->max / lat_ticks_per_ns);
+	  first = 0;
+	}
+    }
+  if (json)
+    {
+      fprintf(json, "\n  ]\n}\n");
+      fclose(json);
+    }
+}
+
+#endif /* __KMA_LATENCY_H__ */
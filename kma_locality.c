@@ -0,0 +1,390 @@
+/***************************************************************************
+ *  Title: Locality Analysis
+ * -------------------------------------------------------------------------
+ *    Purpose: Replays traces against every allocator of kma_bench.h and
+ *             scores where the blocks end up for a program that uses
+ *             them: how many cache lines and pages the live blocks are
+ *             spread over against the lines their bytes need, how far
+ *             apart blocks allocated one after the other are, and the
+ *             miss rates of a simulated LRU cache and TLB for an access
+ *             model of the program
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_bench.h"
+#include "kma_bitmap.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define LINESIZE 64
+#define LINESHIFT 6
+// the pages of the TLB, those of the machine and not of the pool
+#define TLBSHIFT 12
+
+#define POOLBYTES ((unsigned long) MAXPAGES * PAGESIZE)
+#define POOLLINES ((int) (POOLBYTES / LINESIZE))
+
+// the line of an address in the pool, which is aligned to its size like
+// in PAGEINDEX
+#define LINEINDEX(x) ((int) (((unsigned long) (x) / LINESIZE) & (POOLLINES - 1)))
+
+// the access model: every block is written whole when it is allocated
+// and read whole before it is freed, with MODEL_RANDOM also the first
+// line of touches random live blocks after every operation
+#define MODEL_FILL 0
+#define MODEL_RANDOM 1
+
+// a set associative cache with LRU replacement of units of 1 << shift
+// bytes
+typedef struct
+{
+  int sets;
+  int ways;
+  int shift;
+  unsigned long* tag; // unit + 1 by set and way, 0 if empty
+  unsigned long* used; // when the way was used last
+  unsigned long clock;
+  long accesses;
+  long misses;
+} lru_t;
+
+typedef struct
+{
+  double lines; // lines of the live blocks against the lines they need
+  double pages; // pages the live blocks are on, on average
+  double same_page; // allocations on the page of the one before
+  double distance; // bytes to the block allocated before, on average
+  double cache_miss; // miss rates of the cache and the TLB
+  double tlb_miss;
+  int refused; // requests the allocator turned down, they are left out
+} locality_t;
+
+/************Global Variables*********************************************/
+
+static int model = MODEL_RANDOM;
+static int touches = 4;
+static int every = 1000; // operations between two looks at the live set
+
+// the live blocks by request id, in no order, and where an id is
+static int* live = NULL;
+static int* where = NULL;
+static int n_live = 0;
+
+static kma_word_t line_map[BITMAP_WORDS(POOLLINES)];
+static kma_word_t page_map[BITMAP_WORDS(MAXPAGES)];
+
+/************Function Prototypes******************************************/
+void analyze(trace_t*, backend_t*, lru_t*, lru_t*, locality_t*);
+void lru_init(lru_t*, int, int, int);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+static char* name = NULL;
+
+static char* usage[] =
+  {
+    "[-m fill|random:n] [-c cacheKB] [-w ways] [-t tlbEntries] [-s every] "
+    "[-a algorithm]... [-o output] traceFile [traceFile...]",
+    "a 32 KB 8-way cache and a 64 entry TLB by default, "
+    "writes kma_locality.csv",
+    NULL
+  };
+
+int
+main(int argc, char* argv[])
+{
+  int opt, i, j, cache_kb = 32, ways = 8, tlb = 64;
+  int use[N_BACKENDS], any = 0;
+  char* output = "kma_locality.csv";
+  FILE* csv;
+
+  name = argv[0];
+  memset(use, 0, sizeof(use));
+  while ((opt = getopt(argc, argv, "m:c:w:t:s:a:o:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'm':
+	  if (strcmp(optarg, "fill") == 0)
+	    model = MODEL_FILL;
+	  else if (sscanf(optarg, "random:%d", &touches) == 1 && touches >= 0)
+	    model = MODEL_RANDOM;
+	  else
+	    error("unknown access model", optarg);
+	  break;
+	case 'c':
+	  cache_kb = atoi(optarg);
+	  break;
+	case 'w':
+	  ways = atoi(optarg);
+	  break;
+	case 't':
+	  tlb = atoi(optarg);
+	  break;
+	case 's':
+	  every = atoi(optarg);
+	  break;
+	case 'a':
+	  if ((j = find_backend(optarg)) < 0)
+	    error("unknown algorithm", optarg);
+	  use[j] = any = 1;
+	  break;
+	case 'o':
+	  output = optarg;
+	  break;
+	default:
+	  usage_exit(name, usage);
+	}
+    }
+  if (optind >= argc || ways < 1 || cache_kb * 1024 / LINESIZE < ways ||
+      tlb < 4 || every < 1)
+    usage_exit(name, usage);
+  if (!any)
+    for (j = 0; j < N_BACKENDS; j++)
+      use[j] = 1;
+
+  lru_t cache, pages;
+  lru_init(&cache, cache_kb * 1024 / LINESIZE / ways, ways, LINESHIFT);
+  lru_init(&pages, tlb / 4, 4, TLBSHIFT);
+
+  if ((csv = fopen(output, "w")) == NULL)
+    error("unable to open output file", output);
+  fprintf(csv, "time,trace,algorithm,model,lines,pages,same_page,distance,"
+	  "cache_miss,tlb_miss,refused\n");
+  printf("%-20s %-10s %7s %7s %7s %9s %7s %7s %7s\n", "trace", "algorithm",
+	 "lines", "pages", "same", "distance", "cache", "tlb", "refused");
+  for (i = optind; i < argc; i++)
+    {
+      trace_t* trace = read_trace(argv[i]);
+
+      replay_tables(trace);
+      live = realloc(live, (trace->n_req + 1) * sizeof(int));
+      where = realloc(where, (trace->n_req + 1) * sizeof(int));
+      for (j = 0; j < N_BACKENDS; j++)
+	{
+	  locality_t res;
+
+	  if (!use[j])
+	    continue;
+	  analyze(trace, &backends[j], &cache, &pages, &res);
+	  printf("%-20s %-10s %7.3f %7.1f %6.1f%% %9.0f %6.2f%% %6.2f%% "
+		 "%7d\n", argv[i], backends[j].name, res.lines, res.pages,
+		 100.0 * res.same_page, res.distance, 100.0 * res.cache_miss,
+		 100.0 * res.tlb_miss, res.refused);
+	  fprintf(csv, "%ld,%s,%s,%s,%.4f,%.2f,%.4f,%.1f,%.6f,%.6f,%d\n",
+		  (long) time(NULL), argv[i], backends[j].name,
+		  model == MODEL_FILL ? "fill" : "random", res.lines,
+		  res.pages, res.same_page, res.distance, res.cache_miss,
+		  res.tlb_miss, res.refused);
+	}
+    }
+  fclose(csv);
+  return 0;
+}
+
+void
+lru_init(lru_t* c, int sets, int ways, int shift)
+{
+  c->sets = sets;
+  c->ways = ways;
+  c->shift = shift;
+  c->tag = malloc(sets * ways * sizeof(unsigned long));
+  c->used = malloc(sets * ways * sizeof(unsigned long));
+}
+
+static void
+lru_reset(lru_t* c)
+{
+  memset(c->tag, 0, c->sets * c->ways * sizeof(unsigned long));
+  memset(c->used, 0, c->sets * c->ways * sizeof(unsigned long));
+  c->clock = 0;
+  c->accesses = 0;
+  c->misses = 0;
+}
+
+// look an address up, a miss takes the way used least recently
+static inline void
+lru_access(lru_t* c, unsigned long addr)
+{
+  unsigned long unit = (addr >> c->shift) + 1;
+  int set = unit % c->sets, i, victim = 0;
+  unsigned long* tag = &c->tag[set * c->ways];
+  unsigned long* used = &c->used[set * c->ways];
+
+  c->accesses++;
+  c->clock++;
+  for (i = 0; i < c->ways; i++)
+    {
+      if (tag[i] == unit)
+	{
+	  used[i] = c->clock;
+	  return;
+	}
+      if (used[i] < used[victim])
+	victim = i;
+    }
+  c->misses++;
+  tag[victim] = unit;
+  used[victim] = c->clock;
+}
+
+// every line of bytes at ptr
+static void
+touch(lru_t* cache, lru_t* pages, char* ptr, int bytes)
+{
+  unsigned long a = (unsigned long) ptr & ~(unsigned long) (LINESIZE - 1);
+  unsigned long end = (unsigned long) ptr + bytes;
+
+  for (; a < end; a += LINESIZE)
+    {
+      lru_access(cache, a);
+      lru_access(pages, a);
+    }
+}
+
+// the lines and pages the live blocks are on
+static void
+footprint(int* lines, int* pages, long* bytes)
+{
+  int i;
+
+  memset(line_map, 0, sizeof(line_map));
+  memset(page_map, 0, sizeof(page_map));
+  *bytes = 0;
+  for (i = 0; i < n_live; i++)
+    {
+      char* ptr = blocks[live[i]];
+      int size = sizes[live[i]];
+      int first = LINEINDEX(ptr), last = LINEINDEX(ptr + size - 1);
+      int p;
+
+      bitmap_set_run(line_map, first, last - first + 1);
+      for (p = PAGEINDEX(ptr); p <= PAGEINDEX(ptr + size - 1); p++)
+	bitmap_set(page_map, p);
+      *bytes += size;
+    }
+  *lines = bitmap_count(line_map, BITMAP_WORDS(POOLLINES));
+  *pages = bitmap_count(page_map, BITMAP_WORDS(MAXPAGES));
+}
+
+/***********************************************************************
+ *  Title: Analyze a replay
+ * ---------------------------------------------------------------------
+ *    Purpose: Replay a trace against an allocator with the accesses of
+ *             the model going through the cache and the TLB, and look
+ *             at the live blocks every so many operations. The random
+ *             touches start from the same seed for every allocator, so
+ *             all of them see the same accesses by request id.
+ ***********************************************************************/
+void
+analyze(trace_t* trace, backend_t* b, lru_t* cache, lru_t* pages,
+	locality_t* res)
+{
+  int i, k, lines, in_pages, looks = 0, allocs = 0, same = 0;
+  // a short trace is looked at 10 times at least
+  int step = every < trace->n_ops / 10 || trace->n_ops < 10 ? every :
+    trace->n_ops / 10;
+  long bytes;
+  double line_sum = 0.0, need_sum = 0.0, page_sum = 0.0, dist_sum = 0.0;
+  unsigned int seed = 1;
+  char* prev = NULL;
+
+  lru_reset(cache);
+  lru_reset(pages);
+  n_live = 0;
+  res->refused = 0;
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      kma_trace_op_t* op = &trace->ops[i];
+
+      if (op->op == TRACE_REQUEST)
+	{
+	  char* ptr = b->malloc(op->size);
+
+	  blocks[op->id] = ptr;
+	  sizes[op->id] = op->size;
+	  if (ptr)
+	    {
+	      if (prev)
+		{
+		  dist_sum += ptr > prev ? ptr - prev : prev - ptr;
+		  same += BASEADDR(ptr) == BASEADDR(prev);
+		  allocs++;
+		}
+	      prev = ptr;
+	      touch(cache, pages, ptr, op->size);
+	      where[op->id] = n_live;
+	      live[n_live++] = op->id;
+	    }
+	  else
+	    res->refused++;
+	}
+      else if (blocks[op->id])
+	{
+	  int last = live[--n_live];
+
+	  touch(cache, pages, blocks[op->id], sizes[op->id]);
+	  b->free(blocks[op->id], sizes[op->id]);
+	  blocks[op->id] = NULL;
+	  live[where[op->id]] = last;
+	  where[last] = where[op->id];
+	}
+
+      if (model == MODEL_RANDOM)
+	for (k = 0; k < touches && n_live > 0; k++)
+	  {
+	    seed = seed * 1103515245 + 12345;
+	    touch(cache, pages, blocks[live[(seed >> 8) % n_live]], 1);
+	  }
+
+      if ((i + 1) % step == 0 && n_live > 0)
+	{
+	  footprint(&lines, &in_pages, &bytes);
+	  line_sum += lines;
+	  need_sum += (bytes + LINESIZE - 1) / LINESIZE;
+	  page_sum += in_pages;
+	  looks++;
+	}
+    }
+  if (pages_in_use() != 0)
+    error("not all pages freed by", b->name);
+
+  res->lines = need_sum > 0 ? line_sum / need_sum : 0.0;
+  res->pages = looks ? page_sum / looks : 0.0;
+  res->same_page = allocs ? (double) same / allocs : 0.0;
+  res->distance = allocs ? dist_sum / allocs : 0.0;
+  res->cache_miss = cache->accesses ? (double) cache->misses /
+    cache->accesses : 0.0;
+  res->tlb_miss = pages->accesses ? (double) pages->misses /
+    pages->accesses : 0.0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  printf("Test: FAILED\n");
+  exit(-1);
+}
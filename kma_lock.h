@@ -0,0 +1,167 @@
+/***************************************************************************
+ *  Title: Locks and Atomics
+ * -------------------------------------------------------------------------
+ *    Purpose: Locks and atomic counters for the concurrent mode of the
+ *             allocators (KMA_CONCURRENT). Without KMA_CONCURRENT they
+ *             do nothing, so the single threaded allocators stay as
+ *             they are
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_LOCK_H__
+#define __KMA_LOCK_H__
+
+/************System include***********************************************/
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#endif
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#ifdef KMA_CONCURRENT
+typedef pthread_mutex_t kma_lock_t;
+#define KMA_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+//the locks this thread took with kma_lock and how many of them it had
+//to wait for (in kma_page.c, the harness reads them)
+extern __thread long kma_lock_acquired;
+extern __thread long kma_lock_contended;
+#else
+typedef int kma_lock_t;
+#define KMA_LOCK_INITIALIZER 0
+#endif
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Lock operations
+ * ---------------------------------------------------------------------
+ *    Purpose: Take and release a lock. kma_trylock returns TRUE if it
+ *             got the lock, it never waits. kma_lock counts the locks
+ *             it takes and the ones it finds taken
+ ***********************************************************************/
+static inline void
+kma_lock(kma_lock_t* lock)
+{
+#ifdef KMA_CONCURRENT
+  if (pthread_mutex_trylock(lock) != 0)
+    {
+      kma_lock_contended++;
+      pthread_mutex_lock(lock);
+    }
+  kma_lock_acquired++;
+#else
+  (void) lock;
+#endif
+}
+
+static inline void
+kma_unlock(kma_lock_t* lock)
+{
+#ifdef KMA_CONCURRENT
+  pthread_mutex_unlock(lock);
+#else
+  (void) lock;
+#endif
+}
+
+static inline int
+kma_trylock(kma_lock_t* lock)
+{
+#ifdef KMA_CONCURRENT
+  return pthread_mutex_trylock(lock) == 0;
+#else
+  (void) lock;
+  return 1;
+#endif
+}
+
+/***********************************************************************
+ *  Title: Lock ranges
+ * ---------------------------------------------------------------------
+ *    Purpose: Take or release the locks from to to - 1 of an array.
+ *             Locks of one array are always taken in ascending order,
+ *             a thread that holds lock i only waits for locks above i
+ *             (kma_trylock may be used for any lock)
+ ***********************************************************************/
+static inline void
+kma_lock_range(kma_lock_t locks[], int from, int to)
+{
+  for (; from < to; from++)
+    kma_lock(&locks[from]);
+}
+
+static inline void
+kma_unlock_range(kma_lock_t locks[], int from, int to)
+{
+  for (; from < to; from++)
+    kma_unlock(&locks[from]);
+}
+
+/***********************************************************************
+ *  Title: Atomic counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Add to a counter that is shared by threads which hold
+ *             different locks and return the new value, read it, set it,
+ *             and
+ *             change it from expected to desired if nobody changed it
+ *             in between (kma_atomic_cas returns TRUE if it did)
+ ***********************************************************************/
+static inline int
+kma_atomic_add(int* counter, int n)
+{
+#ifdef KMA_CONCURRENT
+  return __atomic_add_fetch(counter, n, __ATOMIC_SEQ_CST);
+#else
+  return *counter += n;
+#endif
+}
+
+static inline int
+kma_atomic_load(int* counter)
+{
+#ifdef KMA_CONCURRENT
+  return __atomic_load_n(counter, __ATOMIC_SEQ_CST);
+#else
+  return *counter;
+#endif
+}
+
+static inline void
+kma_atomic_store(int* counter, int n)
+{
+#ifdef KMA_CONCURRENT
+  __atomic_store_n(counter, n, __ATOMIC_SEQ_CST);
+#else
+  *counter = n;
+#endif
+}
+
+static inline int
+kma_atomic_cas(int* counter, int expected, int desired)
+{
+#ifdef KMA_CONCURRENT
+  return __atomic_compare_exchange_n(counter, &expected, desired, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+  if (*counter != expected)
+    return 0;
+  *counter = desired;
+  return 1;
+#endif
+}
+
+#endif /* __KMA_LOCK_H__ */
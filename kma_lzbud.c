@@ -52,6 +52,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_lock.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -62,27 +64,32 @@
 #define MINPOWER 5 //2^5 = 32
 #define MINSIZE 32 //min block size
 #define HDRSIZE 9 //we need an array of size 9 to store 9 diff buffer sizes
-#define MAPSIZE (PAGESIZE/MINSIZE)/(sizeof(int)*8)
+#define MAPBITS (PAGESIZE/MINSIZE) //number of minimum blocks in one page
+#define MAPSIZE BITMAP_WORDS(MAPBITS)
 
+//free blocks are linked both ways so they can be unlinked in O(1)
 typedef struct blk_ptr{
   struct blk_ptr* next;
+  struct blk_ptr* prev;
 } blk_ptr_t;
 
-//2 int is sizeof(int) = 8 *4 = 32 byte
 typedef struct pg_hdr{
   kma_page_t* this;
   //bitmap to decide if buddy is free.
-  unsigned int bitmap[MAPSIZE];
+  kma_word_t bitmap[MAPSIZE];
   struct pg_hdr* prev;
   struct pg_hdr* next;
 } pg_hdr_t;
 
 //buffer list struct
+//globally free blocks (bits zero, can coalesce) are on next,
+//locally free blocks (bits still one, never coalesce) are on local.
 typedef struct {
 	//slack to control lazy buddy system 
 	int slack;
   int size;
   blk_ptr_t* next;
+  blk_ptr_t* local;
 } bf_lst_t;
 
 //controller for free_list and page_list.
@@ -94,7 +101,15 @@ typedef struct {
 } mem_ctrl_t;
 
 /************Global Variables*********************************************/
-static kma_page_t* entry_page = NULL;
+static KMA_LOCAL kma_page_t* entry_page = NULL;
+//one lock for every order (KMA_CONCURRENT), the one of 8192 is for the
+//large blocks. an operation starts with the lock of its order and takes
+//the locks of larger orders in ascending order when it splits or merges.
+//entry_page and new pages need all of them.
+static kma_lock_t class_lock[HDRSIZE] = { [0 ... HDRSIZE - 1] = KMA_LOCK_INITIALIZER };
+#ifdef KMA_WASTE
+static kma_waste_t waste_count;
+#endif
 /************Function Prototypes******************************************/
 mem_ctrl_t* pg_master();
 int next_power_of_two(int);
@@ -102,22 +117,26 @@ void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
 void* find_fit(kma_size_t);
 void init_page();
-void* get_new_free_block(kma_size_t);
+void check_init(int);
+void refill(kma_size_t, int);
+void add_page();
 void add_to_free_list(void*, int);
+void add_to_local_list(void*, int);
 void delete_block(void*, int);
-void set_bit(unsigned int[], int);
-void unset_bit(unsigned int[], int);
-int get_bit(unsigned int[], int);
+void list_push(blk_ptr_t**, void*);
+void list_remove(blk_ptr_t**, void*);
 int get_pos(void*);
+pg_hdr_t* get_pg_hdr(void*);
 int get_index(int);
 void set_bitmap(void*, kma_size_t);
 void unset_bitmap(void*, kma_size_t);
 void* find_buddy(void*, int);
 bool is_free(void*, int);
-bool is_locally_free(void*, int);
-void* find_locally_free_block(kma_size_t);
-void coalesce(void*, kma_size_t);
+int coalesce(void*, kma_size_t);
 void split_block(kma_size_t, int);
+void* get_large_block();
+void free_large_block(void*);
+void free_all();
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -141,19 +160,41 @@ void* kma_malloc(kma_size_t size) {
   if (size + sizeof(void*) > PAGESIZE)  
     return NULL;
 
-  if (entry_page == NULL)
-    init_page();
+  WASTE(rounding, -size);
   if (size < MINSIZE)
   	size = MINSIZE;
   //all operations after round up size can have a benefit for not caring about the size.
   size = next_power_of_two(size);
+  WASTE(rounding, size);
 
+  int ind = get_index(size);
+  kma_lock(&class_lock[ind]);
+  check_init(ind);
   mem_ctrl_t* controller = pg_master();
-  void* block = find_fit(size);
-  controller->allocated++;
+  void* block;
+  if (size > 4096)
+    block = get_large_block();
+  else {
+    block = find_fit(size);
+    WASTE(free, -size);
+  }
+  kma_atomic_add(&controller->allocated, 1);
+  kma_unlock(&class_lock[ind]);
 
   return block;
 }
+//make sure there is an entry_page, called with the lock of ind.
+//the entry_page is set up with all the locks taken.
+void check_init(int ind) {
+  while (entry_page == NULL) {
+    kma_unlock(&class_lock[ind]);
+    kma_lock_range(class_lock, 0, HDRSIZE);
+    if (entry_page == NULL)
+      init_page();
+    kma_unlock_range(class_lock, 0, HDRSIZE);
+    kma_lock(&class_lock[ind]);
+  }
+}
 //initialize the entry_page
 void init_page() {
   kma_page_t* new_page = get_page();
@@ -171,8 +212,9 @@ void init_page() {
   int i;
   for (i = 0; i < HDRSIZE; i++) {
     controller->free_list[i].size = (1 << (i+MINPOWER));
+    controller->free_list[i].slack = 0;
     controller->free_list[i].next = NULL;
-    controller->free_list[i].next = NULL;
+    controller->free_list[i].local = NULL;
   }
   //because we use a block in front of the entry_page
   //to store some info of the page and allocator
@@ -180,6 +222,8 @@ void init_page() {
   //and add (2^i > pre_alloc_size) to free_list
   int pre_alloc = sizeof(kma_page_t*) + sizeof(mem_ctrl_t) + sizeof(pg_hdr_t);
   pre_alloc = next_power_of_two(pre_alloc);
+  WASTE(header, pre_alloc);
+  WASTE(free, PAGESIZE - pre_alloc);
   void* start = (void*)new_page->ptr + pre_alloc;
   void* end = (void*)new_page->ptr + PAGESIZE;
   int sz = pre_alloc;
@@ -192,222 +236,225 @@ void init_page() {
   for (i = 0; i < MAPSIZE; i++) {
   	controller->page_list->bitmap[i] = 0;
   }
-  int pre_alloc_pos = pre_alloc/MINSIZE;
-  for (i = 0; i < pre_alloc_pos; i++) {
-  	set_bit(controller->page_list->bitmap, i);
-  }  
+  bitmap_set_run(controller->page_list->bitmap, 0, pre_alloc/MINSIZE);
   controller->allocated = 0;
   controller->freed = 0;
 
 }
+//get the start position of ptr in the bitmap
 //i = 0: 0-31
 //i = 1: 32-63...
-//set one bit to one.
-void set_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	bitmap[i] = bitmap[i] | flag;
-}
-//set one bit to zero.
-void unset_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	flag = ~flag;
-	bitmap[i] = bitmap[i] & flag;
-}
-//get the value of one bit
-int get_bit(unsigned int bitmap[], int pos) {
-	int i = pos/(sizeof(int)*8);
-	int offset = pos%(sizeof(int)*8);
-	unsigned int flag = 1;
-	flag = flag << offset;
-	if (bitmap[i] & flag)
-		return 1;
-	else
-		return 0;
-}
-//get the start position of ptr in the bitmap
 int get_pos(void* ptr) {
 	return (ptr - BASEADDR(ptr))/MINSIZE;
 }
+//get the page header of the page ptr is in
+pg_hdr_t* get_pg_hdr(void* ptr) {
+	if (BASEADDR(ptr) == entry_page->ptr)
+		return (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
+	else
+		return (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
+}
 //set the bitmap for one blk, set all their corresponding bit to one.
 void set_bitmap(void* blk, kma_size_t size) {
 	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
-	int pos = get_pos(blk);//the start positon on the bitmap;
-	int i;
-	for (i = 0; i < size/MINSIZE; i++)
-		set_bit(current_page->bitmap, pos+i);
+	bitmap_set_run(get_pg_hdr(blk)->bitmap, get_pos(blk), size/MINSIZE);
 }
 //unset the bitmap for one blk, set all their corresponding bit to zero.
 void unset_bitmap(void* blk, kma_size_t size) {
 	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
-	int pos = get_pos(blk);//the start positon on the bitmap;
-	int i;
-	for (i = 0; i < size/MINSIZE; i++)
-		unset_bit(current_page->bitmap, pos+i);
+	bitmap_clear_run(get_pg_hdr(blk)->bitmap, get_pos(blk), size/MINSIZE);
 }
-//get the index for each size. e.g. index(16) = 0, index(32) = 1.
+//get the index for each size. e.g. index(32) = 0, index(64) = 1.
 int get_index(int n) {
   n = next_power_of_two(n);
-  int count = 0;
-  while(n) {
-    count++;
-    n >>= 1;
-  }
-  return count - MINPOWER - 1;
-}
-//if the corresponding bits of request block in bitmap are all ones.
-//the result is versus to the is_free
-bool is_locally_free(void* ptr, int size) {
-	pg_hdr_t* current_page;
-	if (BASEADDR(ptr) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
-	int offset = (ptr-BASEADDR(ptr))/MINSIZE;
-	int i;
-	int flag;
-	for (i = 0; i < size/MINSIZE; i++) {
-		flag = get_bit(current_page->bitmap, offset+i);
-		if (flag != 1) 
-			return FALSE;
-	}
-	return TRUE;
+  return word_ctz(n) - MINPOWER;
 }
-
 //find the free block in the corresponding buffer size list of free_list.
-//if the free block not found, to request a new free block from the larger size block
-//we split the larger block into two and add them into free_list (recursively)
-//until we can find the request size block. 
-//else if there is no larger block in the free_list for this request, get a new page.
+//if the free block not found, refill splits a larger block first.
+//called with the lock of the request order.
 void* find_fit(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
 
   int ind = get_index(size);
+  bf_lst_t* lst = &controller->free_list[ind];
+  if (lst->local == NULL && lst->next == NULL)
+    refill(size, ind);
   void* blk = NULL;
   void* bud = NULL;
-  bf_lst_t lst = controller->free_list[ind];
-  if (lst.next) {
-    blk = (void*)lst.next;
+  //this part is for lazy body
+  //there is any free block, select one to allocate
+  //if the selected block is locally free: slack += 2
+  //else slack += 1
+  if (lst->local) {
+    //locally free, the bits are still one
+    blk = (void*)lst->local;
+    list_remove(&lst->local, blk);
+    lst->slack += 2;
+  }
+  else if (lst->next) {
+    blk = (void*)lst->next;
     //remove free block and set the corresponding bits in bitmap to one.
-    controller->free_list[ind].next = controller->free_list[ind].next->next;
-  	//this part is for lazy body
-  	//there is any free block, select one to allocate
-  	//if the selected block is locally free: slack += 2
-  	//else slack += 1
-  	if (is_locally_free(blk, size)) {
-    	controller->free_list[ind].slack += 2;
-    }
-    else {
-    	controller->free_list[ind].slack += 1;
-    }
-    set_bitmap(blk, size);//set globally free
+    list_remove(&lst->next, blk);
+    lst->slack += 1;
+    set_bitmap(blk, size);
     //check the buddy because we need to mark the other block locally free
     //when we split larger block into two (recursively)
     bud = find_buddy(blk, size);
     //check whether the next one is from split_block or not. 
-    if (controller->free_list[ind].next == bud)
-    	set_bitmap(bud, size);
-  }
-  else {
-    blk = get_new_free_block(size);
+    if (lst->next == bud) {
+      list_remove(&lst->next, bud);
+      set_bitmap(bud, size);
+      list_push(&lst->local, bud);
+    }
   }
   return blk;
 }
+//split the first block of order index into two halves.
+//globally free blocks are split first, the halves keep the
+//state of the block (their bits are not touched).
 void split_block(kma_size_t size, int index) {
 	mem_ctrl_t* controller = pg_master();
-	bf_lst_t lst = controller->free_list[index];
-	blk_ptr_t* current = lst.next;
+	bf_lst_t* lst = &controller->free_list[index];
 	//larger size/2
 	int sz = (1 << (index + MINPOWER -1));
 	//remove larger one, split into small one and add to free_list.
-	controller->free_list[index].next = controller->free_list[index].next->next;
-	add_to_free_list((void*)current + sz, sz);
-	add_to_free_list((void*)current, sz);
+	if (lst->next) {
+		void* current = (void*)lst->next;
+		list_remove(&lst->next, current);
+		add_to_free_list(current + sz, sz);
+		add_to_free_list(current, sz);
+	}
+	else {
+		void* current = (void*)lst->local;
+		list_remove(&lst->local, current);
+		add_to_local_list(current + sz, sz);
+		add_to_local_list(current, sz);
+	}
 }
-//add block to the free_list
+//push block in front of a list
+void list_push(blk_ptr_t** head, void* block) {
+  blk_ptr_t* blk = (blk_ptr_t*)block;
+  blk->prev = NULL;
+  blk->next = *head;
+  if (blk->next)
+    blk->next->prev = blk;
+  *head = blk;
+}
+//unlink block from the list it is on
+void list_remove(blk_ptr_t** head, void* block) {
+  blk_ptr_t* blk = (blk_ptr_t*)block;
+  if (blk->prev)
+    blk->prev->next = blk->next;
+  else
+    *head = blk->next;
+  if (blk->next)
+    blk->next->prev = blk->prev;
+  blk->next = NULL;
+  blk->prev = NULL;
+}
+//add a globally free block to the free_list
 void add_to_free_list(void* block, int size) {
   mem_ctrl_t* controller = pg_master();
   int ind = get_index(size);
-  ((blk_ptr_t*)block)->next = controller->free_list[ind].next;
-  controller->free_list[ind].next = (blk_ptr_t*)block;
+  list_push(&controller->free_list[ind].next, block);
   return;
 }
-//get a new free block
-void* get_new_free_block(kma_size_t size) {;
+//add a locally free block to the free_list
+void add_to_local_list(void* block, int size) {
+  mem_ctrl_t* controller = pg_master();
   int ind = get_index(size);
+  list_push(&controller->free_list[ind].local, block);
+  return;
+}
+//get a free block of order ind, called with the lock of ind.
+//we take the locks of the larger size buffer lists (not include 8192) in
+//ascending order until one has a block, and split it down to ind, letting
+//the locks go on the way. if none has a block, a new page needs all the locks.
+void refill(kma_size_t size, int ind) {
   mem_ctrl_t* controller = pg_master();
-
-  int i;
-  //check the larger size buffer list, not include 8192
-  for (i = ind + 1; i < HDRSIZE - 1; i++) {
-  	bf_lst_t lst = controller->free_list[i];
-  	if (lst.next) {
-  		//split block and re-search the free_list
-			split_block(size, i);
-			return find_fit(size); 
-   	}
+  int all = FALSE; //TRUE once we hold all the locks
+  int i = ind;
+  while (controller->free_list[i].next == NULL && controller->free_list[i].local == NULL) {
+    if (i + 1 < HDRSIZE - 1) {
+      i++;
+      if (!all)
+        kma_lock(&class_lock[i]);
+    }
+    else if (all) {
+      add_page();
+      i = ind;
+    }
+    else {
+      kma_unlock_range(class_lock, ind, i + 1);
+      kma_lock_range(class_lock, 0, HDRSIZE);
+      all = TRUE;
+      i = ind;
+    }
   }
-  //get a new page, because it is not the enrty_page, so we can get extra space
-  //for not including mem_ctrl_t structure any more.
-  //so the pre_alloc_space is smaller than entry_page
+  for (; i > ind; i--) {
+    split_block(size, i);
+    if (!all)
+      kma_unlock(&class_lock[i]);
+  }
+  //keep only the lock of ind
+  if (all) {
+    kma_unlock_range(class_lock, 0, ind);
+    kma_unlock_range(class_lock, ind + 1, HDRSIZE);
+  }
+}
+//get a new page, because it is not the enrty_page, so we can get extra space
+//for not including mem_ctrl_t structure any more.
+//so the pre_alloc_space is smaller than entry_page
+void add_page() {
+  mem_ctrl_t* controller = pg_master();
+  int i;
   kma_page_t* new_page = get_page();
   *((kma_page_t**)new_page->ptr) = new_page;
   pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
   current->this = (kma_page_t*)(new_page->ptr);
-  current->next = NULL;
-  //add this page to page_list
-  pg_hdr_t* previous = controller->page_list;
-  while (previous) {
-    if (previous->next == NULL) {
-      current->prev = previous;
-      previous->next = current;
-      break;
-    }
-    else
-      previous = previous->next;
-  }
+  //add this page to page_list, just behind the entry_page
+  pg_hdr_t* head = controller->page_list;
+  current->prev = head;
+  current->next = head->next;
+  if (head->next)
+    head->next->prev = current;
+  head->next = current;
 
-  if (size > 4096) {
-  	// if size > 4096, just return this page to the request
-    return (void*)((void*)current + sizeof(pg_hdr_t));
+  int pre_alloc = sizeof(kma_page_t*) + sizeof(pg_hdr_t);
+  pre_alloc = next_power_of_two(pre_alloc);
+  WASTE(header, pre_alloc);
+  WASTE(free, PAGESIZE - pre_alloc);
+  void* start = (void*)new_page->ptr + pre_alloc;
+  void* end = (void*)new_page->ptr + PAGESIZE;
+  int sz = pre_alloc;
+  while (start < end) {
+  	add_to_free_list(start, sz);
+  	start += sz;
+  	sz = sz * 2;  	
   }
-  else {
-  	int pre_alloc = sizeof(kma_page_t*) + sizeof(pg_hdr_t);
-	  pre_alloc = next_power_of_two(pre_alloc);
-	  void* start = (void*)new_page->ptr + pre_alloc;
-	  void* end = (void*)new_page->ptr + PAGESIZE;
-	  int sz = pre_alloc;
-	  while (start < end) {
-	  	add_to_free_list(start, sz);
-	  	start += sz;
-	  	sz = sz * 2;  	
-	  }
-	  //init bitmap
-	  int pre_alloc_pos = pre_alloc/MINSIZE;
-	  for (i = 0; i < MAPSIZE; i++) {
-	  	current->bitmap[i] = 0;
-	  }
-	  //set bitmap
-	  for (i = 0; i < pre_alloc_pos; i++) {
-	  	set_bit(current->bitmap, i);
-	  }
-	  return find_fit(size); 
+  //init bitmap
+  for (i = 0; i < MAPSIZE; i++) {
+  	current->bitmap[i] = 0;
   }
+  //set bitmap
+  bitmap_set_run(current->bitmap, 0, pre_alloc/MINSIZE);
+}
+//if size > 4096, the request gets a whole page of its own.
+//only the kma_page_t* is in front of it (like the dummy allocator),
+//a page header would not leave room for requests up to PAGESIZE - 8.
+//its size rounds up to the page, the kma_page_t* is a header.
+void* get_large_block() {
+  kma_page_t* new_page = get_page();
+  *((kma_page_t**)new_page->ptr) = new_page;
+  WASTE(rounding, -(long) sizeof(kma_page_t*));
+  WASTE(header, sizeof(kma_page_t*));
+  return new_page->ptr + sizeof(kma_page_t*);
+}
+//large blocks go back to the page allocator right away
+void free_large_block(void* ptr) {
+  WASTE(rounding, sizeof(kma_page_t*));
+  WASTE(header, -(long) sizeof(kma_page_t*));
+  free_page(*(kma_page_t**)BASEADDR(ptr));
 }
 //find buddy of request block, return the buddy address
 void* find_buddy(void* ptr, int size) {
@@ -421,132 +468,111 @@ void* find_buddy(void* ptr, int size) {
 //if all zeros, return true, means this block is globaly free.
 //else this block is locally free(is_locally_freefor lzbud) 
 bool is_free(void* ptr, int size) {
-	pg_hdr_t* current_page;
-	if (BASEADDR(ptr) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
-	int offset = (ptr-BASEADDR(ptr))/MINSIZE;
-	int i;
-	int flag;
-	for (i = 0; i < size/MINSIZE; i++) {
-		flag = get_bit(current_page->bitmap, offset+i);
-		if (flag != 0) 
-			return FALSE;
-	}
-	return TRUE;
+	return bitmap_run_is_clear(get_pg_hdr(ptr)->bitmap, get_pos(ptr), size/MINSIZE);
 }
-//use to delete block in the free_list.
-//when you coalesce two block, you need to delete two blocks
-//after that, add one larger to the free_list
+//use to delete a globally free block in the free_list.
+//when you coalesce two block, you need to delete the buddy
 //no need to set or unset bitmap
 void delete_block(void* ptr, int size) {
 	mem_ctrl_t* controller = pg_master();
 	int i = get_index(size);
-	bf_lst_t lst = controller->free_list[i];
-	blk_ptr_t* cur = lst.next;
-	blk_ptr_t* prev;
-	if (cur == NULL)
-		return;
-	if (cur == ptr) {
-		controller->free_list[i].next = controller->free_list[i].next->next;
-		cur->next = NULL;
-		return;
-	}
-	else {
-		prev = cur;
-		cur = cur->next;
-		while(cur != NULL) {
-			if (cur == ptr) {
-				prev->next = cur->next;
-				cur->next = NULL;
-				return;
-			}
-			prev = cur;
-			cur = cur->next;
-		}
-	} 
+	list_remove(&controller->free_list[i].next, ptr);
 }
-//coalesce buddy blocks recursively
-void coalesce(void* ptr, kma_size_t size) {
-	void* bud = find_buddy(ptr, size);
-	if (is_free(bud, size)) {
-		delete_block(ptr, size);
+//coalesce buddy blocks, ptr is not on the free_list yet.
+//a buddy with all bits zero is a globally free block of the same size.
+//the bits of ptr stay set until the merged block goes on the free_list,
+//so a block that is still merging never looks free to another thread.
+//called with the lock of size, the lock of the next order is taken before
+//the one of this order goes. returns the order the block ends up in, whose
+//lock we still hold.
+int coalesce(void* ptr, kma_size_t size) {
+	int i = get_index(size);
+	//we don't want to care about 8192
+	//just stop at 4096!
+	while (size < 4096) {
+		void* bud = find_buddy(ptr, size);
+		if (!is_free(bud, size))
+			break;
 		delete_block(bud, size);
-		void* new_blk;
-		if (ptr < bud)
-			new_blk = ptr;
-		else
-			new_blk = bud;
-		int new_size = 2 * size;
-		//we don't want to care about 8192
-		//just ignore it!
-		if (new_size > 4096)
-			return;
-		add_to_free_list(new_blk, new_size);
-		coalesce(new_blk, new_size);
+		kma_lock(&class_lock[i + 1]);
+		kma_unlock(&class_lock[i]);
+		if (bud < ptr)
+			ptr = bud;
+		size = 2 * size;
+		i++;
 	}
-}
-//find a locally_free_block of a given size
-//or return NULL
-void* find_locally_free_block(kma_size_t size) {
-	mem_ctrl_t* controller = pg_master();
-	int ind = get_index(size);
-	bf_lst_t lst = controller->free_list[ind];
-	blk_ptr_t* cur = lst.next;
-	while (cur != NULL) {
-		if (is_locally_free(cur, size))
-			return cur;
-		cur = cur->next;
-	}
-	return (void*)cur;
+	unset_bitmap(ptr, size);
+	add_to_free_list(ptr, size);
+	return i;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 { 
+	WASTE(rounding, size);
 	if (size < MINSIZE) 
 		size = MINSIZE;
 	size = next_power_of_two(size);
-	mem_ctrl_t* controller = pg_master();
+	WASTE(rounding, -size);
+	//a block of the buddy system is free space again, local or not
+	if (size <= 4096)
+		WASTE(free, size);
 	int ind = get_index(size);
+	kma_lock(&class_lock[ind]);
+	mem_ctrl_t* controller = pg_master();
 	int slck = controller->free_list[ind].slack;
+	//whole pages are not part of the buddy system
+	if (size > 4096) {
+		free_large_block(ptr);
+	}
 	//if slack >= 2
 	//mark it locally free and free it locally
 	//slack -= 2.
-	if (slck >= 2) {
-		add_to_free_list(ptr, size);
+	else if (slck >= 2) {
+		add_to_local_list(ptr, size);
 		controller->free_list[ind].slack -= 2;
 	}
 	//if slack = 1
 	//mark it globally free and free it globally; coalesce if possible
 	//slack = 0.
 	else if (slck == 1){
-		add_to_free_list(ptr, size);
-		unset_bitmap(ptr, size);
-  	coalesce(ptr, size);
   	controller->free_list[ind].slack = 0;
+  	ind = coalesce(ptr, size);
 	}
 	//if slack = 0
 	//mark it globally free and free it globally; coalesce if possible
 	//select one locally free block of size 2^i and free it globally; coalesce if possible
 	//slack = 0.
+	//the locally free block is taken off its list before the lock of
+	//ind goes in coalesce, it is coalesced after ptr.
 	else if (slck == 0) {
-		add_to_free_list(ptr, size);
-  	unset_bitmap(ptr, size);
-  	coalesce(ptr, size);
+  	blk_ptr_t** local = &controller->free_list[ind].local;
+  	void* locally_free_block = (void*)*local;
+  	if (locally_free_block != NULL)
+  		list_remove(local, locally_free_block);
   	controller->free_list[ind].slack = 0;
-  	void* locally_free_block = find_locally_free_block(size);
+  	int last = coalesce(ptr, size);
   	if (locally_free_block != NULL) {
-  		unset_bitmap(locally_free_block, size);
-  		coalesce(locally_free_block, size);
+  		kma_unlock(&class_lock[last]);
+  		kma_lock(&class_lock[ind]);
+  		last = coalesce(locally_free_block, size);
   	}
-  	controller->free_list[ind].slack = 0;
+  	ind = last;
 	}
 
-  controller->freed++;
-  //if free operations and alloc operations are the same amounts
-  //free all pages
-  if (controller->freed == controller->allocated){
+  int done = kma_atomic_add(&controller->freed, 1) == kma_atomic_load(&controller->allocated);
+  kma_unlock(&class_lock[ind]);
+  if (done)
+    free_all();
+  return;
+}
+//if free operations and alloc operations are the same amounts
+//free all pages.
+//with all the locks taken no other thread is in the middle of
+//kma_malloc or kma_free, so we check again.
+void free_all() {
+  kma_lock_range(class_lock, 0, HDRSIZE);
+  mem_ctrl_t* controller = entry_page ? pg_master() : NULL;
+  if (controller && controller->freed == controller->allocated){
     pg_hdr_t* current_page = controller->page_list;
   	while (current_page) {
     	kma_page_t* page = *(kma_page_t**)current_page->this;
@@ -554,8 +580,28 @@ void kma_free(void* ptr, kma_size_t size)
     	free_page(page);
   	}
   	entry_page = NULL;
+  	WASTE_RESET();
   }
-  return;
+  kma_unlock_range(class_lock, 0, HDRSIZE);
+}
+
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste) {
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//the roots of the heap of this thread go to another one
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = entry_page;
+  heap->count = 0;
+  entry_page = NULL;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+  entry_page = heap->root;
 }
+#endif
 
 #endif // KMA_LZBUD
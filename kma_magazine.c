@@ -0,0 +1,297 @@
+/***************************************************************************
+ *  Title: Magazines
+ * -------------------------------------------------------------------------
+ *    Purpose: A magazine layer (Bonwick and Adams, Magazines and Vmem)
+ *             in front of any of the allocators (KMA_MAGAZINE). Every
+ *             CPU has a loaded and a previous magazine of free blocks
+ *             for each size, a depot keeps the full and the empty
+ *             magazines of a size for all CPUs. A magazine holds M
+ *             blocks, M grows when the lock of the depot is contended.
+ *             Unlike the thread caches, the blocks stay with the CPU
+ *             and not with a thread that may go idle, and a block freed
+ *             by any thread is cached. The depot gives its blocks back
+ *             to the allocator when the pool runs low, or all blocks
+ *             when the program asks for it (kma_magazine_reclaim).
+ *             With KMA_MAGAZINE the allocator is built as
+ *             kma_backend_malloc/kma_backend_free (see kma.h)
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifdef KMA_MAGAZINE
+
+/************System include***********************************************/
+#ifdef KMA_CONCURRENT
+#define _GNU_SOURCE // sched_getcpu
+#include <sched.h>
+#endif
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_lock.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+#define MAGCLASSES 9 //classes of 8 to 4088 bytes, as the thread caches
+#define MAGCPUS 64 //a CPU uses the caches of its number modulo this
+#define MAGMIN 4 //blocks of a magazine to start with
+#define MAGMAX 64 //blocks a magazine can hold
+#define MAGCONTENDED 16 //contended depot locks before M doubles
+#define MAGPRESSURE (MAXPAGES / 4 * 3) //pages in use when the depot goes back
+//class k holds blocks of MAGSIZE(k) bytes (see TCSIZE in kma_tcache.c)
+#define MAGSIZE(k) ((16 << (k)) - (int)sizeof(void*))
+
+typedef struct magazine {
+  struct magazine* next;
+  int rounds;
+  void* round[MAGMAX];
+} magazine_t;
+
+//the magazines of one CPU for one class
+typedef struct {
+  kma_lock_t lock;
+  magazine_t* loaded;
+  magazine_t* previous;
+  long hits;
+  long misses;
+} __attribute__((aligned(64))) mag_cpu_t;
+
+//the magazines of one class no CPU has
+typedef struct {
+  kma_lock_t lock;
+  magazine_t* full;
+  magazine_t* empty;
+  int n_full;
+  //M, the blocks a magazine takes before it counts as full
+  int size;
+  int contended;
+  long exchanges;
+} __attribute__((aligned(64))) mag_depot_t;
+
+/************Global Variables*********************************************/
+//cpu lock before depot lock, none of them while we call the allocator
+static mag_cpu_t cpu_cache[MAGCPUS][MAGCLASSES] =
+  { [0 ... MAGCPUS - 1] = { [0 ... MAGCLASSES - 1] = { KMA_LOCK_INITIALIZER } } };
+static mag_depot_t depot[MAGCLASSES] =
+  { [0 ... MAGCLASSES - 1] = { KMA_LOCK_INITIALIZER, NULL, NULL, 0, MAGMIN } };
+//magazines on or off
+static int enabled = TRUE;
+/************Function Prototypes******************************************/
+int mag_class(kma_size_t);
+mag_cpu_t* mag_cpu(int);
+void mag_lock_depot(mag_depot_t*);
+void* mag_refill(mag_cpu_t*, int);
+void mag_free_magazine(magazine_t*, int);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+//the class of a size, MAGSIZE(k - 1) < size <= MAGSIZE(k)
+int mag_class(kma_size_t size) {
+  int k = 28 - __builtin_clz(size + sizeof(void*) - 1);
+  return k < 0 ? 0 : k;
+}
+//the magazines of class k of the CPU we run on
+mag_cpu_t* mag_cpu(int k) {
+#ifdef KMA_CONCURRENT
+  return &cpu_cache[(unsigned int)sched_getcpu() % MAGCPUS][k];
+#else
+  return &cpu_cache[0][k];
+#endif
+}
+//lock a depot, M doubles every MAGCONTENDED times we have to wait
+void mag_lock_depot(mag_depot_t* d) {
+  if (kma_trylock(&d->lock))
+    return;
+  kma_lock(&d->lock);
+  if (++d->contended % MAGCONTENDED == 0 && d->size < MAGMAX)
+    kma_atomic_store(&d->size, d->size * 2 < MAGMAX ? d->size * 2 : MAGMAX);
+}
+
+void* kma_malloc(kma_size_t size) {
+  if (size > MAGSIZE(MAGCLASSES - 1) || !enabled)
+    return kma_backend_malloc(size);
+
+  int k = mag_class(size);
+  mag_cpu_t* cpu = mag_cpu(k);
+  magazine_t* mag;
+  kma_lock(&cpu->lock);
+  mag = cpu->loaded;
+  if (mag && mag->rounds > 0) {
+    void* blk = mag->round[--mag->rounds];
+    cpu->hits++;
+    kma_unlock(&cpu->lock);
+    return blk;
+  }
+  return mag_refill(cpu, k);
+}
+//the loaded magazine is empty: take the previous one if it has blocks,
+//else trade the empty previous for a full magazine of the depot. if the
+//depot has none, the block comes from the allocator. called with the
+//lock of cpu, which it lets go.
+void* mag_refill(mag_cpu_t* cpu, int k) {
+  mag_depot_t* d = &depot[k];
+  magazine_t* mag = cpu->previous;
+  if (mag && mag->rounds > 0) {
+    cpu->previous = cpu->loaded;
+    cpu->loaded = mag;
+  }
+  else {
+    mag_lock_depot(d);
+    mag = d->full;
+    if (mag) {
+      d->full = mag->next;
+      kma_atomic_add(&d->n_full, -1);
+      d->exchanges++;
+      if (cpu->previous) {
+        cpu->previous->next = d->empty;
+        d->empty = cpu->previous;
+      }
+      cpu->previous = cpu->loaded;
+      cpu->loaded = mag;
+    }
+    kma_unlock(&d->lock);
+  }
+  if (mag == NULL) {
+    cpu->misses++;
+    kma_unlock(&cpu->lock);
+    //the pool runs low, the blocks in the depot are only cached
+    if (kma_atomic_load(&d->n_full) > 0 &&
+        pages_in_use() > MAGPRESSURE)
+      kma_magazine_reclaim(FALSE);
+    return kma_backend_malloc(MAGSIZE(k));
+  }
+  void* blk = mag->round[--mag->rounds];
+  cpu->hits++;
+  kma_unlock(&cpu->lock);
+  return blk;
+}
+
+void kma_free(void* ptr, kma_size_t size) {
+  if (size > MAGSIZE(MAGCLASSES - 1) || !enabled) {
+    kma_backend_free(ptr, size);
+    return;
+  }
+
+  int k = mag_class(size);
+  mag_cpu_t* cpu = mag_cpu(k);
+  mag_depot_t* d = &depot[k];
+  int m = kma_atomic_load(&d->size);
+  magazine_t* mag;
+  kma_lock(&cpu->lock);
+  mag = cpu->loaded;
+  if (mag == NULL || mag->rounds >= m) {
+    //the loaded magazine is full: take the previous one if it has room,
+    //else give the full previous to the depot for an empty magazine
+    mag = cpu->previous;
+    if (mag == NULL || mag->rounds >= m) {
+      mag_lock_depot(d);
+      mag = d->empty;
+      if (mag)
+        d->empty = mag->next;
+      else if ((mag = malloc(sizeof(magazine_t))) == NULL) {
+        kma_unlock(&d->lock);
+        kma_unlock(&cpu->lock);
+        kma_backend_free(ptr, size);
+        return;
+      }
+      mag->rounds = 0;
+      if (cpu->previous) {
+        cpu->previous->next = d->full;
+        d->full = cpu->previous;
+        kma_atomic_add(&d->n_full, 1);
+        d->exchanges++;
+      }
+      kma_unlock(&d->lock);
+    }
+    cpu->previous = cpu->loaded;
+    cpu->loaded = mag;
+  }
+  mag->round[mag->rounds++] = ptr;
+  kma_unlock(&cpu->lock);
+}
+//give the blocks of a magazine of class k back to the allocator
+void mag_free_magazine(magazine_t* mag, int k) {
+  while (mag->rounds > 0)
+    kma_backend_free(mag->round[--mag->rounds], MAGSIZE(k));
+  free(mag);
+}
+//the depot gives all its magazines back, with all the magazines of the
+//CPUs go to the depot first
+void kma_magazine_reclaim(bool all) {
+  int c, k;
+  for (k = 0; k < MAGCLASSES; k++) {
+    mag_depot_t* d = &depot[k];
+    magazine_t* mag;
+    magazine_t* full;
+    magazine_t* empty;
+    for (c = 0; all && c < MAGCPUS; c++) {
+      mag_cpu_t* cpu = &cpu_cache[c][k];
+      kma_lock(&cpu->lock);
+      kma_lock(&d->lock);
+      while ((mag = cpu->loaded) != NULL) {
+        cpu->loaded = cpu->previous;
+        cpu->previous = NULL;
+        mag->next = d->full;
+        d->full = mag;
+      }
+      kma_unlock(&d->lock);
+      kma_unlock(&cpu->lock);
+    }
+    kma_lock(&d->lock);
+    full = d->full;
+    empty = d->empty;
+    d->full = NULL;
+    d->empty = NULL;
+    kma_atomic_store(&d->n_full, 0);
+    kma_unlock(&d->lock);
+    while ((mag = full) != NULL) {
+      full = mag->next;
+      mag_free_magazine(mag, k);
+    }
+    while ((mag = empty) != NULL) {
+      empty = mag->next;
+      free(mag);
+    }
+  }
+}
+
+void kma_magazine_size(int m) {
+  int k;
+  enabled = m > 0;
+  for (k = 0; k < MAGCLASSES; k++)
+    depot[k].size = m < MAGMAX ? m : MAGMAX;
+}
+
+void kma_magazine_stats(long* hits, long* misses, long* exchanges, int* size) {
+  int c, k;
+  *hits = *misses = *exchanges = 0;
+  *size = 0;
+  for (k = 0; k < MAGCLASSES; k++) {
+    for (c = 0; c < MAGCPUS; c++) {
+      kma_lock(&cpu_cache[c][k].lock);
+      *hits += cpu_cache[c][k].hits;
+      *misses += cpu_cache[c][k].misses;
+      kma_unlock(&cpu_cache[c][k].lock);
+    }
+    kma_lock(&depot[k].lock);
+    *exchanges += depot[k].exchanges;
+    if (depot[k].size > *size)
+      *size = depot[k].size;
+    kma_unlock(&depot[k].lock);
+  }
+}
+
+#endif // KMA_MAGAZINE
@@ -52,6 +52,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_lock.h"
+#include "kma_stack.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -62,50 +64,88 @@
 #define MINPOWER 4 //2^4 = 16
 #define MINSIZE 16 //min block size
 #define HDRSIZE 10 //we need an array of size 10 to store 10 diff buffer sizes
+#define KEEPEMPTY 1 //empty pages a buffer size keeps before it frees them
+#ifdef KMA_CONCURRENT
+#define STACKPAGES 1 //pages of free blocks a buffer size keeps on its stack
+#else
+#define STACKPAGES 0 //one thread does not need the stacks
+#endif
+#define CLOSING (-(1 << 30)) //outstanding while free_all runs
 
 typedef struct blk_ptr{
   struct blk_ptr* next;
 } blk_ptr_t;
 
-typedef struct pg_hdr{
+//one entry for every page of the pool (like kmemsizes in 4.4BSD),
+//found with PAGEINDEX, so the pages themselves need no header
+typedef struct pg_info{
   kma_page_t* this;
-  struct pg_hdr* prev;
-  struct pg_hdr* next;
+  //pages of the same buffer size that have free blocks
+  struct pg_info* prev;
+  struct pg_info* next;
   //buffer size for this page
   //for the whole page will divide into same buffer size
   int size; 
-} pg_hdr_t;
+  //number of allocated blocks in this page
+  int used;
+  //free blocks of this page
+  blk_ptr_t* free;
+} pg_info_t;
 
 //buffer list struct
 typedef struct {
   int size;
-  blk_ptr_t* next;
+  //number of empty pages on the list (the entry_page does not count)
+  int empty;
+  pg_info_t* next;
 } bf_lst_t;
 
-//controller for free_list and page_list;
+//controller for free_list
 typedef struct {
-  int allocated;
-  int freed;
   bf_lst_t free_list[HDRSIZE];
-  pg_hdr_t* page_list;
 } mem_ctrl_t;
 /************Global Variables*********************************************/
-static kma_page_t* entry_page = NULL;
+static KMA_LOCAL kma_page_t* entry_page = NULL;
+static pg_info_t page_info[MAXPAGES];
+//one lock for every buffer size (KMA_CONCURRENT), the last one is
+//for the large blocks. entry_page only changes with all of them taken.
+static kma_lock_t class_lock[HDRSIZE] = { [0 ... HDRSIZE - 1] = KMA_LOCK_INITIALIZER };
+//freed blocks of every buffer size (not the large blocks) wait here for
+//kma_malloc, pushed and popped without a lock. only a full stack or an
+//empty one takes the lock and goes to the pages.
+static KMA_LOCAL kma_stack_t class_stack[HDRSIZE];
+//blocks allocated and not freed yet. it is outside the controller, so
+//the lock-free paths can count on it while free_all runs. kma_malloc
+//counts its block before it looks at the stack, so free_all (which
+//moves it from 0 to CLOSING) never runs while a block is taken.
+static KMA_LOCAL int outstanding = 0;
+#ifdef KMA_WASTE
+static kma_waste_t waste_count;
+#endif
 /************Function Prototypes******************************************/
 mem_ctrl_t* pg_master();
 int next_power_of_two(int);
+int get_index(int);
 void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
 void* find_fit(kma_size_t);
 void init_page();
-void* get_new_page(kma_size_t);
+void check_init(int);
+pg_info_t* get_info(void*);
+pg_info_t* get_new_page(kma_size_t);
+void add_blocks(pg_info_t*, void*);
+void add_page(bf_lst_t*, pg_info_t*);
+void remove_page(bf_lst_t*, pg_info_t*);
+void release_page(bf_lst_t*, pg_info_t*);
 void add_to_free_list(void*, int);
+void* get_large_block();
+void free_large_block(void*);
 void free_all();
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 //-----------Allocator-----------//
-//The manager of the allocater, keep tracking the free_list and page_list
+//The manager of the allocater, keep tracking the free_list
 mem_ctrl_t* pg_master(){
   return (mem_ctrl_t*)((void*)entry_page->ptr + sizeof(kma_page_t*));
 }
@@ -128,18 +168,29 @@ void* kma_malloc(kma_size_t size) {
   if (size + sizeof(void*) > PAGESIZE)  
     return NULL;
 
-  if (entry_page == NULL)
-    init_page();
-
+  WASTE(rounding, -size);
   //size need to consider the header of block
   size += sizeof(blk_ptr_t);
   if (size < MINSIZE)
     size = MINSIZE;
   //all operations after round up size can have a benefit for not caring about the size.
   size = next_power_of_two(size);
-  mem_ctrl_t* controller = pg_master();
-  void* block = find_fit(size);
-  controller->allocated++;
+  int ind = get_index(size);
+  void* block = NULL;
+  WASTE(rounding, size);
+  //while free_all runs we wait for it on the lock
+  if (kma_atomic_add(&outstanding, 1) > 0 && size <= 4096)
+    block = kma_stack_pop(&class_stack[ind]);
+  if (block)
+    return block;
+
+  kma_lock(&class_lock[ind]);
+  check_init(ind);
+  if (size > 4096)
+    block = get_large_block();
+  else
+    block = find_fit(size);
+  kma_unlock(&class_lock[ind]);
 
   return block;
 }
@@ -151,29 +202,37 @@ void init_page() {
   *((kma_page_t**)new_page->ptr) = new_page;
 
   mem_ctrl_t* controller = pg_master();
-  
-  controller->page_list = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-  // use this to point to the kma_page_t struct for free_page()
-  controller->page_list->this = (kma_page_t*)new_page->ptr;
-  controller->page_list->prev = NULL;
-  controller->page_list->next = NULL;
-  //denote buffer size for this page
-  controller->page_list->size = MINSIZE;
   int i;
   //initialize the free_list for each buffer size
   for (i = 0; i < HDRSIZE; i++) {
     controller->free_list[i].size = 1 << (i + MINPOWER);
+    controller->free_list[i].empty = 0;
     controller->free_list[i].next = NULL;
   }
-  //add the free blocks of whole page to free_list
-  void* start = (void*)new_page->ptr + sizeof(kma_page_t*) + sizeof(mem_ctrl_t) + sizeof(pg_hdr_t);
-  void* end = (void*)new_page->ptr + PAGESIZE;
-  while(start+MINSIZE < end) {
-    add_to_free_list(start, MINSIZE);
-    start += MINSIZE;
+  //the rest of the entry_page is divided into MINSIZE blocks
+  pg_info_t* info = get_info(new_page->ptr);
+  info->this = new_page;
+  info->size = MINSIZE;
+  info->used = 0;
+  info->free = NULL;
+  add_blocks(info, (void*)new_page->ptr + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
+  add_page(&controller->free_list[0], info);
+}
+//make sure there is an entry_page, called with the lock of ind.
+//the entry_page is set up with all the locks taken.
+void check_init(int ind) {
+  while (entry_page == NULL) {
+    kma_unlock(&class_lock[ind]);
+    kma_lock_range(class_lock, 0, HDRSIZE);
+    if (entry_page == NULL)
+      init_page();
+    kma_unlock_range(class_lock, 0, HDRSIZE);
+    kma_lock(&class_lock[ind]);
   }
-  controller->allocated = 0;
-  controller->freed = 0;
+}
+//get the side table entry of the page ptr is in
+pg_info_t* get_info(void* ptr) {
+  return &page_info[PAGEINDEX(ptr)];
 }
 //get the index for each size. e.g. index(16) = 0, index(32) = 1.
 int get_index(int n) {
@@ -185,94 +244,196 @@ int get_index(int n) {
   }
   return count - MINPOWER - 1;
 }
-//find the free block in the corresponding buffer size list of free_list.
-//if the free block not found, to request a new page of the request buffer.
+//take a free block from the first page on the list of the request buffer size.
+//if there is no page with a free block, to request a new page of the request buffer.
 void* find_fit(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
 
   int ind = get_index(size);
-  void* blk = NULL;
-  bf_lst_t lst = controller->free_list[ind];
-  if (lst.next) {
-    blk = (void*)lst.next;
-    //remove from free_list
-    controller->free_list[ind].next = controller->free_list[ind].next->next;
-  }
-  else {
-    blk = get_new_page(size);
-  }
+  bf_lst_t* lst = &controller->free_list[ind];
+  pg_info_t* info = lst->next;
+  if (info == NULL)
+    info = get_new_page(size);
+
+  blk_ptr_t* blk = info->free;
+  //remove from the free list of the page
+  info->free = blk->next;
+  WASTE(free, -size);
+  if (info->used++ == 0 && info->this != entry_page)
+    lst->empty--;
+  //a full page leaves the list until one of its blocks is freed
+  if (info->free == NULL)
+    remove_page(lst, info);
 
-  return blk;
+  return (void*)blk;
 }
-//get a new page
-void* get_new_page(kma_size_t size) {
-	mem_ctrl_t* controller = pg_master();
+//get a new page, the whole page is divided into blocks of size
+pg_info_t* get_new_page(kma_size_t size) {
+  mem_ctrl_t* controller = pg_master();
+  bf_lst_t* lst = &controller->free_list[get_index(size)];
   kma_page_t* new_page = get_page();
-  *((kma_page_t**)new_page->ptr) = new_page;
-  pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
-  current->this = (kma_page_t*)(new_page->ptr);
-  current->next = NULL;
-  current->size = size;
-
-  pg_hdr_t* previous = controller->page_list;
-  while (previous) {
-    if (previous->next == NULL) {
-      current->prev = previous;
-      previous->next = current;
-      break;
-    }
-    else
-      previous = previous->next;
-  }
-
-  if (size > 4096) {
-  	// if size > 4096, just return this page to the request
-    return (void*)((void*)current + sizeof(pg_hdr_t));
-  }
-  else {
-    void* start = (void*)current + sizeof(pg_hdr_t);
-    void* end = (void*)new_page->ptr + PAGESIZE;
-    void* temp = start;
-    start += size;//already allocate one!!!!!remember!
-    while (start + size < end) {
-    	add_to_free_list(start, size);
-    	start += size;
-    }
-    return temp;//not recursion
+  pg_info_t* info = get_info(new_page->ptr);
+  info->this = new_page;
+  info->size = size;
+  info->used = 0;
+  info->free = NULL;
+  add_blocks(info, new_page->ptr);
+  add_page(lst, info);
+  lst->empty++;
+  return info;
+}
+//divide the page from start to its end into free blocks
+//what is in front of start and behind the last block is header.
+void add_blocks(pg_info_t* info, void* start) {
+  void* end = (void*)info->this->ptr + PAGESIZE;
+  int n = 0;
+  while (start + info->size <= end) {
+    ((blk_ptr_t*)start)->next = info->free;
+    info->free = (blk_ptr_t*)start;
+    start += info->size;
+    n++;
   }
+  WASTE(free, n * info->size);
+  WASTE(header, PAGESIZE - n * info->size);
+}
+//add page in front of the list of its buffer size
+void add_page(bf_lst_t* lst, pg_info_t* info) {
+  info->prev = NULL;
+  info->next = lst->next;
+  if (info->next)
+    info->next->prev = info;
+  lst->next = info;
+}
+//unlink page from the list of its buffer size
+void remove_page(bf_lst_t* lst, pg_info_t* info) {
+  if (info->prev)
+    info->prev->next = info->next;
+  else
+    lst->next = info->next;
+  if (info->next)
+    info->next->prev = info->prev;
+}
+//give an empty page back, its blocks are only on its own free list
+void release_page(bf_lst_t* lst, pg_info_t* info) {
+  remove_page(lst, info);
+  WASTE(free, -PAGESIZE);
+  free_page(info->this);
 }
-//add block to the free_list
+//if size > 4096, the request gets a whole page of its own.
+//only the kma_page_t* is in front of it (like the dummy allocator),
+//a page header would not leave room for requests up to PAGESIZE - 8.
+//its size rounds up to the page, the kma_page_t* is a header.
+void* get_large_block() {
+  kma_page_t* new_page = get_page();
+  *((kma_page_t**)new_page->ptr) = new_page;
+  WASTE(rounding, -(long) sizeof(kma_page_t*));
+  WASTE(header, sizeof(kma_page_t*));
+  return new_page->ptr + sizeof(kma_page_t*);
+}
+//large blocks go back to the page allocator right away
+void free_large_block(void* ptr) {
+  WASTE(rounding, sizeof(kma_page_t*));
+  WASTE(header, -(long) sizeof(kma_page_t*));
+  free_page(*(kma_page_t**)BASEADDR(ptr));
+}
+//add block to the free list of its page
 void add_to_free_list(void* block, int size) {
   mem_ctrl_t* controller = pg_master();
-  int ind = get_index(size);
-  // we just add the free_block in front of the free_list
-  ((blk_ptr_t*)block)->next = controller->free_list[ind].next;
-  controller->free_list[ind].next = (blk_ptr_t*)block;
+  bf_lst_t* lst = &controller->free_list[get_index(size)];
+  pg_info_t* info = get_info(block);
+  //a full page comes back on the list
+  if (info->free == NULL)
+    add_page(lst, info);
+  // we just add the free_block in front of the free list
+  ((blk_ptr_t*)block)->next = info->free;
+  info->free = (blk_ptr_t*)block;
+  WASTE(free, size);
+  //an empty page is freed, unless the buffer size has no empty page left.
+  //keeping one stops a size that goes up and down by a block
+  //from getting and freeing the same page all the time.
+  if (--info->used == 0 && info->this != entry_page) {
+    if (lst->empty < KEEPEMPTY)
+      lst->empty++;
+    else
+      release_page(lst, info);
+  }
   return;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 { 
+  WASTE(rounding, size);
 	size += sizeof(blk_ptr_t);
   if (size < MINSIZE) 
     size = MINSIZE;
   size = next_power_of_two(size);
-  //if (size <= 4096)
-  add_to_free_list(ptr, size);
-  mem_ctrl_t* controller = pg_master();
-  controller->freed++;
-  //if free operations and alloc operations are the same amounts
-  //free all pages
-  if (controller->freed == controller->allocated){
-    pg_hdr_t* current_page = controller->page_list;
-  	while (current_page) {
-    	kma_page_t* page = *(kma_page_t**)current_page->this;
-    	current_page = current_page->next;
-    	free_page(page);
-  	}
-  	entry_page = NULL;
+  int ind = get_index(size);
+  WASTE(rounding, -size);
+  //a full stack sends the block back to its page
+  if (size > 4096 || !kma_stack_push(&class_stack[ind], ptr, STACKPAGES * PAGESIZE / size)) {
+    kma_lock(&class_lock[ind]);
+    if (size > 4096)
+      free_large_block(ptr);
+    else
+      add_to_free_list(ptr, size);
+    kma_unlock(&class_lock[ind]);
   }
+  if (kma_atomic_add(&outstanding, -1) == 0)
+    free_all();
   return;
 }
+//if free operations and alloc operations are the same amounts
+//free all pages, they are all empty, so they are all on the lists
+//once the blocks on the stacks are back in their pages.
+//with all the locks taken no other thread is in the middle of
+//the locked paths, and none takes a block while outstanding is CLOSING.
+void free_all() {
+  kma_lock_range(class_lock, 0, HDRSIZE);
+  mem_ctrl_t* controller = entry_page ? pg_master() : NULL;
+  if (controller && kma_atomic_cas(&outstanding, 0, CLOSING)){
+    int i;
+    void* blk;
+    for (i = 0; i < HDRSIZE; i++) {
+      while ((blk = kma_stack_pop(&class_stack[i])) != NULL)
+        add_to_free_list(blk, controller->free_list[i].size);
+    }
+    for (i = 0; i < HDRSIZE; i++) {
+      pg_info_t* info = controller->free_list[i].next;
+      while (info) {
+        kma_page_t* page = info->this;
+        info = info->next;
+        if (page != entry_page)
+          free_page(page);
+      }
+    }
+    //the controller is in the entry_page, free it last
+    free_page(entry_page);
+  	entry_page = NULL;
+    WASTE_RESET();
+    kma_atomic_add(&outstanding, -CLOSING);
+  }
+  kma_unlock_range(class_lock, 0, HDRSIZE);
+}
+
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste) {
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//the roots of the heap of this thread go to another one
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = entry_page;
+  heap->count = outstanding;
+  entry_page = NULL;
+  outstanding = 0;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+  entry_page = heap->root;
+  outstanding = heap->count;
+}
+#endif
 
 #endif // KMA_MCK2
@@ -0,0 +1,330 @@
+/***************************************************************************
+ *  Title: Microbenchmarks
+ * -------------------------------------------------------------------------
+ *    Purpose: Runs access patterns the random traces mix together (LIFO,
+ *             FIFO, same-size churn, alternating sizes, ramp and bulk
+ *             free, buddy splitting) at several request sizes against
+ *             every allocator of kma_bench.h, and reports the time per
+ *             operation and the memory overhead at the peak
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_bench.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// blocks a pattern keeps at most (request ids go up to 2 * LIVE), and
+// how often it goes through them
+#define LIVE 1000
+#define ROUNDS 50
+
+// every pattern stays below this many operations
+#define MAXOPS (4 * LIVE * ROUNDS + 4 * LIVE)
+
+typedef struct
+{
+  char* name;
+  void (*make)(trace_t*, int);
+} pattern_t;
+
+/************Global Variables*********************************************/
+
+// the request sizes every pattern runs with, twice the largest still
+// fits a page
+static int micro_sizes[] = { 16, 128, 1024, 4000 };
+
+#define N_SIZES ((int) (sizeof(micro_sizes) / sizeof(int)))
+
+/************Function Prototypes******************************************/
+void lifo(trace_t*, int);
+void fifo(trace_t*, int);
+void churn(trace_t*, int);
+void alternate(trace_t*, int);
+void ramp(trace_t*, int);
+void buddy(trace_t*, int);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+static pattern_t patterns[] =
+  {
+    { "lifo",      lifo      },
+    { "fifo",      fifo      },
+    { "churn",     churn     },
+    { "alternate", alternate },
+    { "ramp",      ramp      },
+    { "buddy",     buddy     },
+  };
+
+#define N_PATTERNS ((int) (sizeof(patterns) / sizeof(pattern_t)))
+
+static char* name = NULL;
+
+static char* usage[] =
+  {
+    "[-w warmup] [-n reps] [-a algorithm]... [-p pattern]",
+    "writes kma_micro.csv",
+    NULL
+  };
+
+// the pattern that is being made, for the error of op_next
+static char* making = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  int opt, p, s, j, r, warmup = 1, reps = 3;
+  int use[N_BACKENDS], any = 0;
+  char* only = NULL;
+  FILE* csv;
+
+  name = argv[0];
+  memset(use, 0, sizeof(use));
+  while ((opt = getopt(argc, argv, "w:n:a:p:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'w':
+	  warmup = atoi(optarg);
+	  break;
+	case 'n':
+	  reps = atoi(optarg);
+	  break;
+	case 'a':
+	  if ((j = find_backend(optarg)) < 0)
+	    error("unknown algorithm", optarg);
+	  use[j] = any = 1;
+	  break;
+	case 'p':
+	  only = optarg;
+	  break;
+	default:
+	  usage_exit(name, usage);
+	}
+    }
+  if (optind != argc || warmup < 0 || reps < 1)
+    usage_exit(name, usage);
+  if (!any)
+    for (j = 0; j < N_BACKENDS; j++)
+      use[j] = 1;
+
+  trace_t trace;
+  trace.n_req = 2 * LIVE;
+  trace.ops = malloc(MAXOPS * sizeof(kma_trace_op_t));
+  replay_tables(&trace);
+
+  if ((csv = fopen("kma_micro.csv", "w")) == NULL)
+    error("unable to open output file", "kma_micro.csv");
+  fprintf(csv, "time,pattern,size,algorithm,ops,ns_per_op,peak,overhead\n");
+  printf("%-10s %5s %-10s %8s %9s %6s %9s\n", "pattern", "size",
+	 "algorithm", "ops", "ns/op", "peak", "overhead");
+  for (p = 0; p < N_PATTERNS; p++)
+    {
+      if (only && strcmp(only, patterns[p].name) != 0)
+	continue;
+      for (s = 0; s < N_SIZES; s++)
+	{
+	  trace.n_ops = 0;
+	  making = patterns[p].name;
+	  patterns[p].make(&trace, micro_sizes[s]);
+
+	  for (j = 0; j < N_BACKENDS; j++)
+	    {
+	      replay_stat_t stat;
+	      double best = 0.0;
+
+	      if (!use[j])
+		continue;
+	      check_replay(&trace, &backends[j], &stat);
+	      for (r = 0; r < warmup; r++)
+		timed_replay(&trace, &backends[j]);
+	      for (r = 0; r < reps; r++)
+		{
+		  double t = timed_replay(&trace, &backends[j]);
+
+		  if (r == 0 || t < best)
+		    best = t;
+		}
+
+	      // pages at the peak against the bytes requested at the peak
+	      double ns = best * 1e9 / trace.n_ops;
+	      double overhead = (double) stat.peak * PAGESIZE /
+		stat.peak_bytes - 1.0;
+
+	      printf("%-10s %5d %-10s %8d %9.1f %6d %8.1f%%\n",
+		     patterns[p].name, micro_sizes[s], backends[j].name,
+		     trace.n_ops, ns, stat.peak, 100.0 * overhead);
+	      fprintf(csv, "%ld,%s,%d,%s,%d,%.2f,%d,%.4f\n", (long) time(NULL),
+		      patterns[p].name, micro_sizes[s], backends[j].name,
+		      trace.n_ops, ns, stat.peak, overhead);
+	    }
+	}
+    }
+  fclose(csv);
+  return 0;
+}
+
+// the next operation of a pattern, there is room for MAXOPS
+static kma_trace_op_t*
+op_next(trace_t* trace)
+{
+  if (trace->n_ops >= MAXOPS)
+    error("too many operations in pattern", making);
+  return &trace->ops[trace->n_ops++];
+}
+
+// add a request or a free of request id to a pattern
+static void
+op_alloc(trace_t* trace, int id, int size)
+{
+  kma_trace_op_t* op = op_next(trace);
+
+  op->op = TRACE_REQUEST;
+  op->id = id;
+  op->size = size;
+}
+
+static void
+op_free(trace_t* trace, int id)
+{
+  kma_trace_op_t* op = op_next(trace);
+
+  op->op = TRACE_FREE;
+  op->id = id;
+  op->size = 0;
+}
+
+// LIVE blocks, freed newest first
+void
+lifo(trace_t* trace, int size)
+{
+  int r, i;
+
+  for (r = 0; r < ROUNDS; r++)
+    {
+      for (i = 0; i < LIVE; i++)
+	op_alloc(trace, i, size);
+      for (i = LIVE - 1; i >= 0; i--)
+	op_free(trace, i);
+    }
+}
+
+// a queue of LIVE blocks, the oldest is freed for every new one
+void
+fifo(trace_t* trace, int size)
+{
+  int i;
+
+  for (i = 0; i < LIVE; i++)
+    op_alloc(trace, i, size);
+  for (i = 0; i < LIVE * ROUNDS; i++)
+    {
+      op_free(trace, i % LIVE);
+      op_alloc(trace, i % LIVE, size);
+    }
+  for (i = 0; i < LIVE; i++)
+    op_free(trace, i);
+}
+
+// LIVE blocks of one size, a random one is freed and allocated again
+void
+churn(trace_t* trace, int size)
+{
+  unsigned int seed = 1;
+  int i;
+
+  for (i = 0; i < LIVE; i++)
+    op_alloc(trace, i, size);
+  for (i = 0; i < LIVE * ROUNDS; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      op_free(trace, (seed >> 16) % LIVE);
+      op_alloc(trace, (seed >> 16) % LIVE, size);
+    }
+  for (i = 0; i < LIVE; i++)
+    op_free(trace, i);
+}
+
+// LIVE blocks of size and twice size in turn, freed oldest first
+void
+alternate(trace_t* trace, int size)
+{
+  int r, i;
+
+  for (r = 0; r < ROUNDS; r++)
+    {
+      for (i = 0; i < LIVE; i++)
+	op_alloc(trace, i, i % 2 ? 2 * size : size);
+      for (i = 0; i < LIVE; i++)
+	op_free(trace, i);
+    }
+}
+
+// every round allocates more blocks than the one before, up to 2 * LIVE,
+// then frees them all at once
+void
+ramp(trace_t* trace, int size)
+{
+  int r, i, n;
+
+  for (r = 1; r <= ROUNDS; r++)
+    {
+      n = 2 * LIVE * r / ROUNDS;
+      for (i = 0; i < n; i++)
+	op_alloc(trace, i, size);
+      for (i = 0; i < n; i++)
+	op_free(trace, i);
+    }
+}
+
+// the bad case of a buddy system: LIVE blocks, every other one freed so
+// no pair can merge, then blocks of twice the size that cannot use the
+// holes and split new memory
+void
+buddy(trace_t* trace, int size)
+{
+  int r, i;
+
+  for (r = 0; r < ROUNDS; r++)
+    {
+      for (i = 0; i < LIVE; i++)
+	op_alloc(trace, i, size);
+      for (i = 0; i < LIVE; i += 2)
+	op_free(trace, i);
+      for (i = 0; i < LIVE / 2; i++)
+	op_alloc(trace, LIVE + i, 2 * size);
+      for (i = 1; i < LIVE; i += 2)
+	op_free(trace, i);
+      for (i = 0; i < LIVE / 2; i++)
+	op_free(trace, LIVE + i);
+    }
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  printf("Test: FAILED\n");
+  exit(-1);
+}
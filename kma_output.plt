@@ -1,8 +1,18 @@
 set term png
 set output "kma_output.png"
+# the pool in memory (mincore) is sampled less often, in kma_rss.dat
 plot "kma_output.dat" using 1:2 with lines title "Requested", \
-     "kma_output.dat" using 1:3 with lines title "Allocated"
+     "kma_output.dat" using 1:3 with lines title "Allocated", \
+     "kma_rss.dat" using 1:3 with lines title "Resident"
 
+# the waste of kma_waste.dat stacked: every curve adds one more part
+# (header, free, rounding, then what the allocator does not count), the
+# top one is the waste of kma_output.dat
 set output "kma_waste.png"
-plot "kma_output.dat" using 1:($3-$2) with lines title "Waste"
-     
+set style fill solid 0.6 noborder
+set key top left
+plot "kma_waste.dat" using 1:($2+$3+$4+$5) with filledcurves x1 title "Other", \
+     "kma_waste.dat" using 1:($2+$3+$4) with filledcurves x1 title "Rounding", \
+     "kma_waste.dat" using 1:($2+$3) with filledcurves x1 title "Free", \
+     "kma_waste.dat" using 1:2 with filledcurves x1 title "Header", \
+     "kma_output.dat" using 1:($3-$2) with lines lc rgb "black" title "Waste"
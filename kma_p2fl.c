@@ -52,6 +52,9 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_lock.h"
+#include "kma_stack.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -62,9 +65,20 @@
 #define MINPOWER 4 //2^4 = 16
 #define MINSIZE 16 //min block size
 #define HDRSIZE 10 //we need an array of size 10 to store 10 diff buffer sizes
+#define MAPBITS (PAGESIZE/MINSIZE) //number of minimum blocks in one page
+#define KEEPEMPTY 1 //empty pages we keep before we free them
+#ifdef KMA_CONCURRENT
+#define STACKPAGES 1 //pages of free blocks a buffer size keeps on its stack
+#else
+#define STACKPAGES 0 //one thread does not need the stacks
+#endif
+#define CLOSING (-(1 << 30)) //outstanding while free_all runs
 
+//free blocks are linked both ways in a circular list,
+//so a block can be unlinked without knowing its size
 typedef struct blk_ptr{
   struct blk_ptr* next;
+  struct blk_ptr* prev;
 } blk_ptr_t;
 
 
@@ -76,31 +90,70 @@ typedef struct pg_hdr{
   int f_size; 
 } pg_hdr_t;
 
+//one entry for every page of the pool, found with PAGEINDEX
+typedef struct {
+  //number of allocated blocks in this page
+  int used;
+  //one bit at the start of every block cut from this page
+  kma_word_t start[BITMAP_WORDS(MAPBITS)];
+} pg_info_t;
+
 //buffer list struct
+//head is the list head, the list is empty if head.next == &head
 typedef struct {
   int size;
-  blk_ptr_t* next;
+  blk_ptr_t head;
 } bf_lst_t;
 
 //controller for free_list and page_list;
 typedef struct {
-  int allocated;
-  int freed;
+  //number of empty pages we keep (the entry_page does not count)
+  int empty;
   bf_lst_t free_list[HDRSIZE];
   pg_hdr_t* page_list;
 } mem_ctrl_t;
 
 /************Global Variables*********************************************/
-static kma_page_t* entry_page = NULL;
+static KMA_LOCAL kma_page_t* entry_page = NULL;
+static pg_info_t page_info[MAXPAGES];
+//one lock for every buffer size (KMA_CONCURRENT), the last one is
+//for the large blocks. entry_page only changes with all of them taken.
+static kma_lock_t class_lock[HDRSIZE] = { [0 ... HDRSIZE - 1] = KMA_LOCK_INITIALIZER };
+//the page_list and the free space of the pages, taken after class locks
+static kma_lock_t page_lock = KMA_LOCK_INITIALIZER;
+//freed blocks of every buffer size (not the large blocks) wait here for
+//kma_malloc, pushed and popped without a lock. only a full stack or an
+//empty one takes the lock and goes to the free_list and the pages.
+static KMA_LOCAL kma_stack_t class_stack[HDRSIZE];
+//blocks allocated and not freed yet, outside the controller like in
+//KMA_MCK2: kma_malloc counts its block before it looks at the stack,
+//so free_all (which moves it from 0 to CLOSING) never runs while a
+//block is taken.
+static KMA_LOCAL int outstanding = 0;
+#ifdef KMA_WASTE
+static kma_waste_t waste_count;
+#endif
 /************Function Prototypes******************************************/
 mem_ctrl_t* pg_master();
 int next_power_of_two(int);
+int get_index(int);
 void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
 void* find_fit(kma_size_t);
 void init_page();
+void check_init(int);
+pg_info_t* get_info(void*);
+void reset_page(pg_hdr_t*, int);
+void* cut_block(pg_hdr_t*, kma_size_t);
 void* get_new_free_block(kma_size_t);
+void add_page(pg_hdr_t*);
+void remove_page(pg_hdr_t*);
 void add_to_free_list(void*, int);
+void delete_block(void*);
+void empty_page(pg_hdr_t*);
+void try_empty_page(pg_hdr_t*, int);
+void* get_large_block();
+void free_large_block(void*);
 void free_all();
 /************External Declaration*****************************************/
 
@@ -128,18 +181,29 @@ void* kma_malloc(kma_size_t size) {
   if (size + sizeof(void*) > PAGESIZE)  
     return NULL;
 
-  if (entry_page == NULL)
-    init_page();
-
+  WASTE(rounding, -size);
   //size need to consider the header of block
-  size += sizeof(blk_ptr_t);
+  size += sizeof(blk_ptr_t*);
   if (size < MINSIZE)
     size = MINSIZE;
   //all operations after round up size can have a benefit for not caring about the size.
   size = next_power_of_two(size);
-  mem_ctrl_t* controller = pg_master();
-  void* block = find_fit(size);
-  controller->allocated++;
+  int ind = get_index(size);
+  void* block = NULL;
+  WASTE(rounding, size);
+  //while free_all runs we wait for it on the lock
+  if (kma_atomic_add(&outstanding, 1) > 0 && size <= 4096)
+    block = kma_stack_pop(&class_stack[ind]);
+  if (block)
+    return block;
+
+  kma_lock(&class_lock[ind]);
+  check_init(ind);
+  if (size > 4096)
+    block = get_large_block();
+  else
+    block = find_fit(size);
+  kma_unlock(&class_lock[ind]);
 
   return block;
 }
@@ -158,15 +222,43 @@ void init_page() {
   controller->page_list->prev = NULL;
   controller->page_list->next = NULL;
   //the free space for this page
-  controller->page_list->f_size = PAGESIZE - sizeof(kma_page_t*) - sizeof(mem_ctrl_t) - sizeof(pg_hdr_t);
+  reset_page(controller->page_list, sizeof(kma_page_t*) + sizeof(mem_ctrl_t) + sizeof(pg_hdr_t));
+  WASTE(header, PAGESIZE - controller->page_list->f_size);
+  WASTE(free, controller->page_list->f_size);
   int i;
   //initialize the free_list for each buffer size
   for (i = 0; i < HDRSIZE; i++) {
     controller->free_list[i].size = 1 << (i + MINPOWER);
-    controller->free_list[i].next = NULL;
+    controller->free_list[i].head.next = &controller->free_list[i].head;
+    controller->free_list[i].head.prev = &controller->free_list[i].head;
   } 
-  controller->allocated = 0;
-  controller->freed = 0;
+  controller->empty = 0;
+}
+//make sure there is an entry_page, called with the lock of ind.
+//the entry_page is set up with all the locks taken.
+void check_init(int ind) {
+  while (entry_page == NULL) {
+    kma_unlock(&class_lock[ind]);
+    kma_lock_range(class_lock, 0, HDRSIZE);
+    if (entry_page == NULL)
+      init_page();
+    kma_unlock_range(class_lock, 0, HDRSIZE);
+    kma_lock(&class_lock[ind]);
+  }
+}
+//get the side table entry of the page ptr is in
+pg_info_t* get_info(void* ptr) {
+  return &page_info[PAGEINDEX(ptr)];
+}
+//make the whole page behind the header free space again.
+//blocks start at a multiple of MINSIZE so they each have a bit in start.
+void reset_page(pg_hdr_t* current, int hdr) {
+  pg_info_t* info = get_info(current);
+  int i;
+  current->f_size = (PAGESIZE - hdr) & ~(MINSIZE - 1);
+  info->used = 0;
+  for (i = 0; i < BITMAP_WORDS(MAPBITS); i++)
+    info->start[i] = 0;
 }
 //get the index for each size. e.g. index(16) = 0, index(32) = 1.
 int get_index(int n) {
@@ -186,28 +278,42 @@ void* find_fit(kma_size_t size) {
 
   int ind = get_index(size);
   void* blk = NULL;
-  bf_lst_t lst = controller->free_list[ind];
-  if (lst.next) {
-    blk = (void*)lst.next;
+  blk_ptr_t* head = &controller->free_list[ind].head;
+  if (head->next != head) {
+    blk = (void*)head->next;
     //remove from free_list
-    controller->free_list[ind].next = controller->free_list[ind].next->next;
+    delete_block(blk);
   }
   else {
     blk = get_new_free_block(size);
   }
+  WASTE(free, -size);
+  //an empty page we kept is in use again
+  if (kma_atomic_add(&get_info(blk)->used, 1) == 1 && BASEADDR(blk) != entry_page->ptr)
+    kma_atomic_add(&controller->empty, -1);
 
   return blk;
 }
+//cut a block of size from the free space of the page
+void* cut_block(pg_hdr_t* current, kma_size_t size) {
+  void* blk = (void*)current->this + (PAGESIZE - current->f_size);
+  current->f_size -= size;
+  bitmap_set(get_info(blk)->start, (blk - BASEADDR(blk)) / MINSIZE);
+  return blk;
+}
 //get a new free block.
 void* get_new_free_block(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
+  kma_lock(&page_lock);
   pg_hdr_t* current_page = controller->page_list;
+  void* blk;
 
   while (current_page) {
-    //check if request size <= 4096 and this page has enough size
-    if (size <= 4096 && current_page->f_size > size) {
-      current_page->f_size = current_page->f_size - size;
-      return (void*)((void*)current_page->this + (PAGESIZE - current_page->f_size) - size);
+    //check if this page has enough size
+    if (current_page->f_size > size) {
+      blk = cut_block(current_page, size);
+      kma_unlock(&page_lock);
+      return blk;
     }
     else 
       current_page = current_page->next;
@@ -219,54 +325,160 @@ void* get_new_free_block(kma_size_t size) {
   *((kma_page_t**)new_page->ptr) = new_page;
   pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
   current->this = (kma_page_t*)(new_page->ptr);
-  current->next = NULL;
-  current->f_size = PAGESIZE - sizeof(kma_page_t*) - sizeof(pg_hdr_t);
-  //add this page to the page_list
-  pg_hdr_t* previous = controller->page_list;
-  while (previous) {
-    if (previous->next == NULL) {
-      current->prev = previous;
-      previous->next = current;
-      break;
-    }
-    else
-      previous = previous->next;
-  }
+  reset_page(current, sizeof(kma_page_t*) + sizeof(pg_hdr_t));
+  WASTE(header, PAGESIZE - current->f_size);
+  WASTE(free, current->f_size);
+  kma_atomic_add(&controller->empty, 1);
+  add_page(current);
 
-  if (size > 4096) {
-    // if size > 4096, just return this page to the request
-    current->f_size = 0;
-    return (void*)((void*)current + sizeof(pg_hdr_t));
-  }
-  else {
-    current->f_size -= size;
-    return (void*)((void*)new_page->ptr + (PAGESIZE - current->f_size) - size); 
-  }
+  blk = cut_block(current, size);
+  kma_unlock(&page_lock);
+  return blk;
+}
+//add page to the page_list, just behind the entry_page,
+//so the search for free space finds it first
+void add_page(pg_hdr_t* current) {
+  pg_hdr_t* head = pg_master()->page_list;
+  current->prev = head;
+  current->next = head->next;
+  if (head->next)
+    head->next->prev = current;
+  head->next = current;
+}
+//unlink page from the page_list
+void remove_page(pg_hdr_t* current) {
+  current->prev->next = current->next;
+  if (current->next)
+    current->next->prev = current->prev;
+}
+//if size > 4096, the request gets a whole page of its own.
+//only the kma_page_t* is in front of it (like the dummy allocator),
+//a page header would not leave room for requests up to PAGESIZE - 8.
+//its size rounds up to the page, the kma_page_t* is a header.
+void* get_large_block() {
+  kma_page_t* new_page = get_page();
+  *((kma_page_t**)new_page->ptr) = new_page;
+  WASTE(rounding, -(long) sizeof(kma_page_t*));
+  WASTE(header, sizeof(kma_page_t*));
+  return new_page->ptr + sizeof(kma_page_t*);
+}
+//large blocks go back to the page allocator right away
+void free_large_block(void* ptr) {
+  WASTE(rounding, sizeof(kma_page_t*));
+  WASTE(header, -(long) sizeof(kma_page_t*));
+  free_page(*(kma_page_t**)BASEADDR(ptr));
 }
 //add block to the free_list
 void add_to_free_list(void* block, int size) {
   mem_ctrl_t* controller = pg_master();
   int ind = get_index(size);
+  blk_ptr_t* head = &controller->free_list[ind].head;
+  blk_ptr_t* blk = (blk_ptr_t*)block;
   // we just add the free_block in front of the free_list
-  ((blk_ptr_t*)block)->next = controller->free_list[ind].next;
-  controller->free_list[ind].next = (blk_ptr_t*)block;
+  blk->prev = head;
+  blk->next = head->next;
+  head->next->prev = blk;
+  head->next = blk;
+  WASTE(free, size);
+  if (kma_atomic_add(&get_info(block)->used, -1) == 0 && BASEADDR(block) != entry_page->ptr)
+    try_empty_page((pg_hdr_t*)(BASEADDR(block) + sizeof(kma_page_t*)), ind);
   return;
 }
+//the blocks of an empty page are on the lists of any buffer size,
+//so emptying it needs all the class locks. we hold the lock of ind
+//and must not wait for the others, if one is taken the page stays
+//as it is (its blocks are still used, and all pages go in free_all).
+void try_empty_page(pg_hdr_t* current, int ind) {
+  int i;
+  for (i = 0; i < HDRSIZE; i++) {
+    if (i != ind && !kma_trylock(&class_lock[i]))
+      break;
+  }
+  //no block of the page can be taken while we hold all the locks
+  if (i == HDRSIZE && kma_atomic_load(&get_info(current)->used) == 0) {
+    kma_lock(&page_lock);
+    empty_page(current);
+    kma_unlock(&page_lock);
+  }
+  while (i-- > 0) {
+    if (i != ind)
+      kma_unlock(&class_lock[i]);
+  }
+}
+//unlink block from the free_list it is on
+void delete_block(void* block) {
+  blk_ptr_t* blk = (blk_ptr_t*)block;
+  blk->prev->next = blk->next;
+  blk->next->prev = blk->prev;
+}
+//all blocks of the page are free, take them off the free_list.
+//then keep the page as free space (KEEPEMPTY pages at most, so a
+//load that goes up and down does not get and free pages all the time)
+//or give it back.
+void empty_page(pg_hdr_t* current) {
+  mem_ctrl_t* controller = pg_master();
+  void* page = BASEADDR(current);
+  pg_info_t* info = get_info(page);
+  int i;
+  for (i = 0; i < BITMAP_WORDS(MAPBITS); i++) {
+    kma_word_t w = info->start[i];
+    while (w) {
+      delete_block(page + (i * WORDBITS + word_ctz(w)) * MINSIZE);
+      w &= w - 1;
+    }
+  }
+  remove_page(current);
+  if (controller->empty < KEEPEMPTY) {
+    reset_page(current, sizeof(kma_page_t*) + sizeof(pg_hdr_t));
+    kma_atomic_add(&controller->empty, 1);
+    add_page(current);
+  }
+  else {
+    //all its blocks are free, the page is the space reset_page made
+    int space = (PAGESIZE - sizeof(kma_page_t*) - sizeof(pg_hdr_t)) & ~(MINSIZE - 1);
+    WASTE(free, -space);
+    WASTE(header, space - PAGESIZE);
+    free_page(*(kma_page_t**)page);
+  }
+}
 
 void kma_free(void* ptr, kma_size_t size)
 { 
-  size += sizeof(blk_ptr_t);
+  WASTE(rounding, size);
+  size += sizeof(blk_ptr_t*);
   if (size < MINSIZE) 
     size = MINSIZE;
   // same measurement as kma_malloc
   size = next_power_of_two(size);
-
-  add_to_free_list(ptr, size);
-  mem_ctrl_t* controller = pg_master();
-  controller->freed++;
-  //if free operations and alloc operations are the same amounts
-  //free all pages
-  if (controller->freed == controller->allocated){
+  int ind = get_index(size);
+  WASTE(rounding, -size);
+  //a full stack sends the block to the free_list
+  if (size > 4096 || !kma_stack_push(&class_stack[ind], ptr, STACKPAGES * PAGESIZE / size)) {
+    kma_lock(&class_lock[ind]);
+    if (size > 4096)
+      free_large_block(ptr);
+    else
+      add_to_free_list(ptr, size);
+    kma_unlock(&class_lock[ind]);
+  }
+  if (kma_atomic_add(&outstanding, -1) == 0)
+    free_all();
+  return;
+}
+//if free operations and alloc operations are the same amounts
+//free all pages, the blocks on the stacks go with them.
+//with all the locks taken no other thread is in the middle of
+//the locked paths, and none takes a block while outstanding is CLOSING.
+void free_all() {
+  kma_lock_range(class_lock, 0, HDRSIZE);
+  kma_lock(&page_lock);
+  mem_ctrl_t* controller = entry_page ? pg_master() : NULL;
+  if (controller && kma_atomic_cas(&outstanding, 0, CLOSING)){
+    int i;
+    for (i = 0; i < HDRSIZE; i++) {
+      while (kma_stack_pop(&class_stack[i]) != NULL)
+        ;
+    }
     pg_hdr_t* current_page = controller->page_list;
     while (current_page) {
       kma_page_t* page = *(kma_page_t**)current_page->this;
@@ -274,7 +486,32 @@ void kma_free(void* ptr, kma_size_t size)
       free_page(page);
     }
     entry_page = NULL;
+    WASTE_RESET();
+    kma_atomic_add(&outstanding, -CLOSING);
   }
-  return;
+  kma_unlock(&page_lock);
+  kma_unlock_range(class_lock, 0, HDRSIZE);
 }
+
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste) {
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//the roots of the heap of this thread go to another one
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = entry_page;
+  heap->count = outstanding;
+  entry_page = NULL;
+  outstanding = 0;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+  entry_page = heap->root;
+  outstanding = heap->count;
+}
+#endif
+
 #endif // KMA_P2FL
@@ -50,15 +50,23 @@
  #define __KPAGE_IMPL__
 
 /************System include***********************************************/
+#ifdef KMA_CONCURRENT
+#define _GNU_SOURCE // sched_getcpu
+#include <sched.h>
+#endif
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_lock.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -67,16 +75,62 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#ifdef KMA_CONCURRENT
+#define PCPCACHES 64 // page caches, a CPU uses the one of its number modulo this
+#define PCPHIGH 16   // pages a cache keeps at most
+#define PCPBATCH 8   // pages a cache gets from or gives back to the pool at once
+
+// single pages cached for the threads running on a CPU (like the per-cpu
+// pagesets of linux), the lock is only contended when a thread moves
+typedef struct
+{
+  kma_lock_t lock;
+  int count;
+  void* page[PCPHIGH];
+} __attribute__((aligned(64))) pcp_t;
+#endif
+
 /************Global Variables*********************************************/
 static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+
+// the pool is managed as a buddy system of pages (a zone). The
+// bookkeeping lives here and not in the free pages, so pages are
+// not touched before they are handed out.
+static int free_head[MAXORDER + 1];    // first free block of each order
+static int free_next[MAXPAGES];        // free list links, by page index
+static int free_prev[MAXPAGES];
+static signed char free_order[MAXPAGES]; // order of the free block
+                                         // starting here, -1 if none
+
+// pages out of the buddy system, handed out or in a cache. the pool
+// goes away when all of them are back.
+static int pages_out = 0;
+
+// the page allocator is shared by all threads in the concurrent mode.
+// the statistics are atomic, so only the buddy system needs the lock.
+static kma_lock_t page_lock = KMA_LOCK_INITIALIZER;
+
+#ifdef KMA_CONCURRENT
+// the lock counts of kma_lock.h
+__thread long kma_lock_acquired = 0;
+__thread long kma_lock_contended = 0;
+
+// a cache lock is taken before the page_lock
+static pcp_t pcp[PCPCACHES] =
+  { [0 ... PCPCACHES - 1] = { KMA_LOCK_INITIALIZER, 0, { NULL } } };
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+void* allocPages(int);
+void freePages(void*, int);
 void initPages();
+void pushBlock(int, int);
+void removeBlock(int, int);
+void* pcpGet();
+bool pcpPut(void*);
+void pcpDrain();
 
 /************External Declaration*****************************************/
 
@@ -84,19 +138,55 @@ void initPages();
 
 kma_page_t*
 get_page()
+{
+  return get_pages(0);
+}
+
+kma_page_t*
+get_pages(int order)
 {
   static int id = 0;
   kma_page_t* res;
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  assert(order >= 0 && order <= MAXORDER);
   
   res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
   
-  assert(res->ptr != NULL);
+  kma_atomic_add(&kma_page_stats.num_requested, 1 << order);
+  kma_atomic_add(&kma_page_stats.num_in_use, 1 << order);
+  
+  res->id = kma_atomic_add(&id, 1) - 1;
+  res->size = kma_page_stats.page_size << order;
+  res->ptr = order == 0 ? pcpGet() : NULL;
+  if (res->ptr == NULL)
+    {
+      kma_lock(&page_lock);
+      res->ptr = allocPages(order);
+      kma_unlock(&page_lock);
+    }
+  // the pages may all sit in the caches
+  if (res->ptr == NULL)
+    {
+      pcpDrain();
+      kma_lock(&page_lock);
+      res->ptr = allocPages(order);
+      kma_unlock(&page_lock);
+    }
+  
+  // a block of pages may just not be free, the allocator turns the
+  // request down
+  if (res->ptr == NULL && order > 0)
+    {
+      kma_atomic_add(&kma_page_stats.num_requested, -(1 << order));
+      kma_atomic_add(&kma_page_stats.num_in_use, -(1 << order));
+      free(res);
+      return NULL;
+    }
+  
+  if (res->ptr == NULL)
+    {
+      error("error: all pages already allocated", "");
+    }
   
   return res;	
 }
@@ -104,62 +194,254 @@ get_page()
 void
 free_page(kma_page_t* ptr)
 {
+  int order = 0;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  while ((kma_page_stats.page_size << order) < ptr->size)
+    order++;
+  
+  assert(kma_atomic_load(&kma_page_stats.num_in_use) >= (1 << order));
   
-  freePage(ptr->ptr);
+  kma_atomic_add(&kma_page_stats.num_freed, 1 << order);
+  kma_atomic_add(&kma_page_stats.num_in_use, -(1 << order));
+  
+  if (order > 0 || !pcpPut(ptr->ptr))
+    {
+      kma_lock(&page_lock);
+      freePages(ptr->ptr, order);
+      kma_unlock(&page_lock);
+    }
   free(ptr);
 }
 
 kma_page_stat_t*
 page_stats()
 {
+#ifdef KMA_CONCURRENT
+  static __thread kma_page_stat_t stats;
+#else
   static kma_page_stat_t stats;
+#endif
+  
+  stats.num_requested = kma_atomic_load(&kma_page_stats.num_requested);
+  stats.num_freed = kma_atomic_load(&kma_page_stats.num_freed);
+  stats.num_in_use = kma_atomic_load(&kma_page_stats.num_in_use);
+  stats.page_size = kma_page_stats.page_size;
+  return &stats;
+}
+
+int
+pages_in_use()
+{
+  return kma_atomic_load(&kma_page_stats.num_in_use);
+}
+
+// the pool is mapped lazily by the system, a page of it is only in
+// memory once it has been written. It stays there until the whole pool
+// is freed, so this follows the most pages the allocator ever had out
+// and not the pages in use.
+long
+pool_resident()
+{
+  // one byte for every system page of the pool (4 KB at least)
+  static unsigned char vec[MAXPAGES * (PAGESIZE / 4096)];
+  long page = sysconf(_SC_PAGESIZE), bytes = 0;
+  int i, n = (long) MAXPAGES * PAGESIZE / page;
+  
+  kma_lock(&page_lock);
+  if (pool != NULL && page >= 4096 &&
+      mincore(pool, (long) MAXPAGES * PAGESIZE, vec) == 0)
+    {
+      for (i = 0; i < n; i++)
+	{
+	  bytes += (vec[i] & 1) * page;
+	}
+    }
+  kma_unlock(&page_lock);
+  return bytes;
+}
+
+long
+minor_faults()
+{
+  struct rusage usage;
+  
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+// take a page from the cache of our CPU, an empty cache gets a batch
+// from the pool first. NULL without caches or if the pool is empty.
+void*
+pcpGet()
+{
+#ifdef KMA_CONCURRENT
+  pcp_t* cache = &pcp[(unsigned int) sched_getcpu() % PCPCACHES];
+  void* ptr = NULL;
+  
+  kma_lock(&cache->lock);
+  if (cache->count == 0)
+    {
+      kma_lock(&page_lock);
+      while (cache->count < PCPBATCH && (ptr = allocPages(0)) != NULL)
+	{
+	  cache->page[cache->count++] = ptr;
+	}
+      kma_unlock(&page_lock);
+    }
+  ptr = cache->count > 0 ? cache->page[--cache->count] : NULL;
+  kma_unlock(&cache->lock);
+  return ptr;
+#else
+  return NULL;
+#endif
+}
+
+// put a page in the cache of our CPU, a full cache gives a batch back
+// to the pool first. FALSE without caches.
+bool
+pcpPut(void* ptr)
+{
+#ifdef KMA_CONCURRENT
+  pcp_t* cache = &pcp[(unsigned int) sched_getcpu() % PCPCACHES];
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  kma_lock(&cache->lock);
+  if (cache->count == PCPHIGH)
+    {
+      kma_lock(&page_lock);
+      while (cache->count > PCPHIGH - PCPBATCH)
+	{
+	  freePages(cache->page[--cache->count], 0);
+	}
+      kma_unlock(&page_lock);
+    }
+  cache->page[cache->count++] = ptr;
+  kma_unlock(&cache->lock);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+// give the pages of all caches back to the pool
+void
+pcpDrain()
+{
+#ifdef KMA_CONCURRENT
+  int i;
+  
+  for (i = 0; i < PCPCACHES; i++)
+    {
+      pcp_t* cache = &pcp[i];
+      
+      kma_lock(&cache->lock);
+      kma_lock(&page_lock);
+      while (cache->count > 0)
+	{
+	  freePages(cache->page[--cache->count], 0);
+	}
+      kma_unlock(&page_lock);
+      kma_unlock(&cache->lock);
+    }
+#endif
+}
+
+// add the free block of 2^order pages starting at page index i
+void
+pushBlock(int i, int order)
+{
+  free_order[i] = order;
+  free_prev[i] = -1;
+  free_next[i] = free_head[order];
+  if (free_head[order] != -1)
+    {
+      free_prev[free_head[order]] = i;
+    }
+  free_head[order] = i;
+}
+
+// unlink the free block starting at page index i
+void
+removeBlock(int i, int order)
+{
+  if (free_prev[i] != -1)
+    {
+      free_next[free_prev[i]] = free_next[i];
+    }
+  else
+    {
+      free_head[order] = free_next[i];
+    }
+  if (free_next[i] != -1)
+    {
+      free_prev[free_next[i]] = free_prev[i];
+    }
+  free_order[i] = -1;
 }
 
 void*
-allocPage()
+allocPages(int order)
 {
-  void* res;
+  int i, cur;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  // take the smallest free block that is large enough...
+  for (cur = order; cur <= MAXORDER && free_head[cur] == -1; cur++)
+    ;
   
-  if (res == NULL)
+  if (cur > MAXORDER)
     {
-      error("error: all pages already allocated", "");
+      return NULL;
     }
   
-  next_free_page = *((void**)next_free_page);
+  i = free_head[cur];
+  removeBlock(i, cur);
+  pages_out += 1 << order;
   
-  assert(res != NULL);
+  // ...and give the upper halves back while splitting it down
+  while (cur > order)
+    {
+      cur--;
+      pushBlock(i + (1 << cur), cur);
+    }
   
-  return res;
+  return pool + i * PAGESIZE;
 }
 
 void
-freePage(void* ptr)
+freePages(void* ptr, int order)
 {
+  int i, buddy;
+  
   assert(ptr != NULL);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  i = (ptr - pool) / PAGESIZE;
+  pages_out -= 1 << order;
   
-  if (kma_page_stats.num_in_use == 0)
+  // merge with the buddy as long as it is free and of the same order
+  while (order < MAXORDER)
+    {
+      buddy = i ^ (1 << order);
+      if (free_order[buddy] != order)
+	{
+	  break;
+	}
+      removeBlock(buddy, order);
+      i &= ~(1 << order);
+      order++;
+    }
+  pushBlock(i, order);
+  
+  if (pages_out == 0)
     {
       free(pool);
       pool = NULL;
-      next_free_page = NULL;
     }
 }
 
@@ -168,23 +450,23 @@ initPages()
 {
   int i;
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
   //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
+  // align the pool to its size, so blocks of any order are aligned
+  int result = posix_memalign(&pool, MAXPAGES * PAGESIZE, MAXPAGES * PAGESIZE);
   if(result)
     error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  for (i = 0; i <= MAXORDER; i++)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
-      
-      *((void**) ptr) = next;
+      free_head[i] = -1;
+    }
+  for (i = 0; i < MAXPAGES; i++)
+    {
+      free_order[i] = -1;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  // the whole pool is one free block
+  pushBlock(0, MAXORDER);
 }
@@ -75,6 +75,8 @@
 
 #define MAXPAGES 4096
 
+#define MAXORDER 12 // MAXPAGES == 1 << MAXORDER, the pool is one buddy block
+
 /***********************************************************************
  *  Title: Base Address Macro
  * ---------------------------------------------------------------------
@@ -85,6 +87,18 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Page Index Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of the page of a pointer in the pool
+ *             (0 to MAXPAGES - 1), to index tables kept on the side.
+ *             The pool is aligned to its size, so this is the page
+ *             number of the address modulo MAXPAGES
+ *    Input: pointer
+ *    Output: the index of the page
+ ***********************************************************************/
+#define PAGEINDEX(x) ((int)((((long) (x)) / PAGESIZE) & (MAXPAGES-1)))
+
 typedef struct
 {
   int id;
@@ -113,10 +127,22 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates 2^order contiguous pages, aligned to their
+ *             total size. Released with free_page like a single page.
+ *    Input: the order (0 <= order <= MAXORDER)
+ *    Output: the allocated memory pages, NULL if there is no free
+ *            block of that order (order > 0, a single page that is not
+ *            there is an error)
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int order);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
- *    Purpose: Releases a memory page
+ *    Purpose: Releases a memory page (or the pages of get_pages)
  *    Input: the pointer to the memory page structure
  *    Output: none
  ***********************************************************************/
@@ -131,6 +157,38 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Pages in use
+ * ---------------------------------------------------------------------
+ *    Purpose: The num_in_use of page_stats without the copy of the
+ *             statistics, for a harness that looks after every
+ *             operation
+ *    Input: none
+ *    Output: the number of pages in use
+ ***********************************************************************/
+EXTERN int pages_in_use();
+
+/***********************************************************************
+ *  Title: Resident pool
+ * ---------------------------------------------------------------------
+ *    Purpose: The bytes of the pool that are in memory (mincore), what
+ *             the allocator costs in RSS. A few microseconds, for
+ *             sampling and not for every operation.
+ *    Input: none
+ *    Output: the resident bytes, 0 while there is no pool
+ ***********************************************************************/
+EXTERN long pool_resident();
+
+/***********************************************************************
+ *  Title: Minor faults
+ * ---------------------------------------------------------------------
+ *    Purpose: The minor page faults of the process so far (getrusage),
+ *             the first touches of pool pages among them
+ *    Input: none
+ *    Output: the number of faults
+ ***********************************************************************/
+EXTERN long minor_faults();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
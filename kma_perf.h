@@ -0,0 +1,212 @@
+/***************************************************************************
+ *  Title: Hardware Counters
+ * -------------------------------------------------------------------------
+ *    Purpose: Cycles, instructions, cache, TLB and branch misses of the
+ *             allocator from perf_event_open, counted in user mode and
+ *             turned on and off together with one prctl, around every
+ *             call or around a whole replay. A counter the machine or
+ *             the kernel does not give us is left out, without any the
+ *             benchmark runs as before.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_PERF_H__
+#define __KMA_PERF_H__
+
+/************System include***********************************************/
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define PERF_COUNTERS 8
+
+// on and off pairs perf_init counts to know what a pair counts alone
+#define PERF_CALIBRATE 10000
+
+// what a counter counts, config is the perf_event_attr config
+typedef struct
+{
+  char* name;
+  unsigned int type;
+  unsigned long long config;
+} perf_event_t;
+
+#ifdef __linux__
+#define PERF_CACHE_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+// the hardware counters first, the software ones work in a VM too
+static perf_event_t perf_events[PERF_COUNTERS] =
+  {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES            },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS          },
+    { "l1d_misses",    PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "llc_misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES          },
+    { "dtlb_misses",   PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES         },
+    { "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK            },
+    { "page_faults",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS           },
+  };
+#else
+static perf_event_t perf_events[PERF_COUNTERS] =
+  {
+    { "cycles" }, { "instructions" }, { "l1d_misses" }, { "llc_misses" },
+    { "dtlb_misses" }, { "branch_misses" }, { "task_clock_ns" },
+    { "page_faults" },
+  };
+#endif
+
+/************Global Variables*********************************************/
+
+// the counters we have, -1 for the others
+static int perf_fd[PERF_COUNTERS] = { [0 ... PERF_COUNTERS - 1] = -1 };
+static int perf_open = 0;
+
+// what an on and off around nothing counts, by counter
+static double perf_overhead[PERF_COUNTERS];
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Switch the counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Start and stop all the counters of this thread at once
+ ***********************************************************************/
+static inline void
+perf_on()
+{
+#ifdef __linux__
+  prctl(PR_TASK_PERF_EVENTS_ENABLE);
+#endif
+}
+
+static inline void
+perf_off()
+{
+#ifdef __linux__
+  prctl(PR_TASK_PERF_EVENTS_DISABLE);
+#endif
+}
+
+/***********************************************************************
+ *  Title: Read the counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Zero the counters, and read them: the counts since the
+ *             reset, scaled up if the kernel had to share the hardware
+ *             between them (NAN for a counter we do not have or that
+ *             never ran)
+ ***********************************************************************/
+static void
+perf_reset()
+{
+#ifdef __linux__
+  int i;
+
+  for (i = 0; i < PERF_COUNTERS; i++)
+    if (perf_fd[i] >= 0)
+      ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+#endif
+}
+
+static void
+perf_read(double* value)
+{
+  int i;
+
+  for (i = 0; i < PERF_COUNTERS; i++)
+    {
+      // value, time enabled, time running
+      unsigned long long v[3];
+
+      value[i] = NAN;
+      if (perf_fd[i] < 0 || read(perf_fd[i], v, sizeof(v)) != sizeof(v) ||
+	  v[2] == 0)
+	continue;
+      value[i] = (double) v[0] * v[1] / v[2];
+    }
+}
+
+/***********************************************************************
+ *  Title: Open the counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Open every counter for this thread, stopped and in user
+ *             mode only, and measure what an on and off count by
+ *             themselves (the mean of many), which comes off the
+ *             counts of every call. Prints the counters that are not
+ *             there once; returns the number we have.
+ ***********************************************************************/
+static int
+perf_init()
+{
+  double v[PERF_COUNTERS];
+  int i, j;
+
+  if (perf_open)
+    return perf_open;
+#ifdef __linux__
+  for (i = 0; i < PERF_COUNTERS; i++)
+    {
+      struct perf_event_attr attr;
+
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = perf_events[i].type;
+      attr.config = perf_events[i].config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+      perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (perf_fd[i] < 0)
+	fprintf(stderr, "counter %s not available: %s\n", perf_events[i].name,
+		strerror(errno));
+      else
+	perf_open++;
+    }
+#endif
+  if (perf_open == 0)
+    {
+      fprintf(stderr, "no counters, running without them\n");
+      return 0;
+    }
+
+  // many on and off at once, a single pair is below the resolution of
+  // the software counters
+  perf_reset();
+  for (j = 0; j < PERF_CALIBRATE; j++)
+    {
+      perf_on();
+      perf_off();
+    }
+  perf_read(v);
+  for (i = 0; i < PERF_COUNTERS; i++)
+    perf_overhead[i] = isnan(v[i]) ? 0.0 : v[i] / PERF_CALIBRATE;
+  return perf_open;
+}
+
+#endif /* __KMA_PERF_H__ */
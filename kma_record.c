@@ -0,0 +1,373 @@
+/***************************************************************************
+ *  Title: Allocation Recorder
+ * -------------------------------------------------------------------------
+ *    Purpose: A library preloaded into any program (LD_PRELOAD) that
+ *             records its malloc, free, realloc and calloc calls in the
+ *             format of kma_record.h. Every thread fills a buffer of its
+ *             own without locks and appends it to the recording with one
+ *             write when it is full, so a call costs a clock read and a
+ *             few stores. kma_trace turns the recording into a trace.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_record.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// records a thread collects before it writes them (32 KB)
+#define RECORD_BUFFER 1024
+
+// dlsym allocates before the real calloc is known, it gets memory from
+// here that is never freed
+#define BOOTSTRAP_SIZE 4096
+
+// the buffer of a thread. Buffers are mapped, never freed and kept on a
+// list; a thread that exits gives its buffer back for the next thread.
+typedef struct buffer
+{
+  struct buffer* next;
+  int busy; // owned by a thread
+  int n;
+  unsigned int tid;
+  kma_record_t records[RECORD_BUFFER];
+} buffer_t;
+
+/************Global Variables*********************************************/
+
+static void* (*real_malloc)(size_t) = NULL;
+static void (*real_free)(void*) = NULL;
+static void* (*real_calloc)(size_t, size_t) = NULL;
+static void* (*real_realloc)(void*, size_t) = NULL;
+
+// the recording, -1 until the library is initialized
+static int fd = -1;
+
+static buffer_t* buffers = NULL;
+static pthread_key_t exit_key;
+
+static __thread buffer_t* mine = NULL;
+// set while the recorder itself runs, its own allocations are not
+// recorded
+static __thread int inside = 0;
+
+static char bootstrap[BOOTSTRAP_SIZE];
+static size_t bootstrap_used = 0;
+static int resolving = 0;
+
+/************Function Prototypes******************************************/
+static void resolve(void);
+static void open_recording(void);
+static void thread_exit(void*);
+static void forked(void);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// append the records of a buffer, O_APPEND keeps the writes of several
+// threads from overwriting each other
+static void
+flush(buffer_t* b)
+{
+  char* p = (char*) b->records;
+  size_t left = b->n * sizeof(kma_record_t);
+
+  while (left > 0 && fd >= 0)
+    {
+      ssize_t w = write(fd, p, left);
+
+      if (w <= 0)
+	break;
+      p += w;
+      left -= w;
+    }
+  b->n = 0;
+}
+
+// a free buffer from the list or a new one
+static buffer_t*
+get_buffer(void)
+{
+  buffer_t* b;
+
+  for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next)
+    {
+      int idle = 0;
+
+      if (__atomic_compare_exchange_n(&b->busy, &idle, 1, 0,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	break;
+    }
+  if (b == NULL)
+    {
+      b = mmap(NULL, sizeof(buffer_t), PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (b == MAP_FAILED)
+	return NULL;
+      b->busy = 1;
+      b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 0,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    }
+  b->n = 0;
+  b->tid = syscall(SYS_gettid);
+  // thread_exit gives it back
+  pthread_setspecific(exit_key, b);
+  return b;
+}
+
+static inline void
+record(unsigned int op, void* ptr, size_t size, unsigned long long time)
+{
+  buffer_t* b = mine;
+  kma_record_t* r;
+
+  if (inside || fd < 0)
+    return;
+  if (b == NULL)
+    {
+      inside++;
+      b = mine = get_buffer();
+      inside--;
+      if (b == NULL)
+	return;
+    }
+
+  r = &b->records[b->n++];
+  r->time = time;
+  r->ptr = (unsigned long long) ptr;
+  r->size = size;
+  r->tid = b->tid;
+  r->op = op;
+  if (b->n == RECORD_BUFFER)
+    {
+      inside++;
+      flush(b);
+      inside--;
+    }
+}
+
+static void
+thread_exit(void* arg)
+{
+  buffer_t* b = arg;
+
+  inside++;
+  flush(b);
+  inside--;
+  mine = NULL;
+  __atomic_store_n(&b->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void
+resolve(void)
+{
+  resolving = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  resolving = 0;
+  if (!real_malloc || !real_free || !real_calloc || !real_realloc)
+    {
+      fprintf(stderr, "kma_record: cannot find the real allocator\n");
+      _exit(1);
+    }
+}
+
+// KMA_RECORD is the prefix of the recording (kma_record), the pid is
+// appended so the children of a shell do not write the same file
+static void
+open_recording(void)
+{
+  char* prefix = getenv("KMA_RECORD");
+  char file[4096];
+  kma_record_header_t header;
+
+  snprintf(file, sizeof(file), "%s.%d", prefix ? prefix : "kma_record",
+	   (int) getpid());
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0)
+    return;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KMA_RECORD_MAGIC, sizeof(header.magic));
+  header.pid = getpid();
+  header.record_size = sizeof(kma_record_t);
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+      close(fd);
+      fd = -1;
+    }
+}
+
+static void __attribute__((constructor))
+record_init(void)
+{
+  inside++;
+  if (real_malloc == NULL)
+    resolve();
+  pthread_key_create(&exit_key, thread_exit);
+  pthread_atfork(NULL, NULL, forked);
+  open_recording();
+  inside--;
+}
+
+// the records of threads still running at exit are written here, the
+// calls after this are lost (kma_trace frees what is left). A program
+// that ends in _exit or a signal loses the records in its buffers.
+static void __attribute__((destructor))
+record_fini(void)
+{
+  buffer_t* b;
+  int f = fd;
+
+  inside++;
+  for (b = buffers; b; b = b->next)
+    if (b->busy)
+      flush(b);
+  fd = -1;
+  if (f >= 0)
+    close(f);
+  inside--;
+}
+
+// the child starts a recording of its own. Its parent writes the records
+// it collected before the fork, and only the forking thread goes on.
+static void
+forked(void)
+{
+  buffer_t* b;
+
+  inside++;
+  for (b = buffers; b; b = b->next)
+    {
+      b->n = 0;
+      if (b != mine)
+	b->busy = 0;
+    }
+  if (mine)
+    mine->tid = syscall(SYS_gettid);
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+  open_recording();
+  inside--;
+}
+
+static int
+in_bootstrap(void* ptr)
+{
+  return (char*) ptr >= bootstrap && (char*) ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+void*
+malloc(size_t size)
+{
+  void* ptr;
+
+  if (real_malloc == NULL)
+    resolve();
+  ptr = real_malloc(size);
+  if (ptr)
+    record(RECORD_MALLOC, ptr, size, now());
+  return ptr;
+}
+
+void
+free(void* ptr)
+{
+  if (ptr == NULL || in_bootstrap(ptr))
+    return;
+  if (real_free == NULL)
+    resolve();
+  record(RECORD_FREE, ptr, 0, now());
+  real_free(ptr);
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+  void* ptr;
+
+  if (real_calloc == NULL)
+    {
+      // dlsym's own calloc, the memory is zero already
+      if (resolving)
+	{
+	  size_t bytes = (n * size + 15) & ~(size_t) 15;
+
+	  if (bootstrap_used + bytes > BOOTSTRAP_SIZE)
+	    return NULL;
+	  ptr = bootstrap + bootstrap_used;
+	  bootstrap_used += bytes;
+	  return ptr;
+	}
+      resolve();
+    }
+  ptr = real_calloc(n, size);
+  if (ptr)
+    record(RECORD_CALLOC, ptr, n * size, now());
+  return ptr;
+}
+
+void*
+realloc(void* old, size_t size)
+{
+  unsigned long long start;
+  void* ptr;
+
+  if (real_realloc == NULL)
+    resolve();
+  if (in_bootstrap(old))
+    {
+      ptr = malloc(size);
+      if (ptr)
+	memcpy(ptr, old, size < BOOTSTRAP_SIZE ? size : BOOTSTRAP_SIZE);
+      return ptr;
+    }
+
+  // the old block is freed only if the call succeeds (or the size is 0)
+  start = now();
+  ptr = real_realloc(old, size);
+  if (old && (ptr || size == 0))
+    record(RECORD_FREE, old, 0, start);
+  if (ptr)
+    record(RECORD_REALLOC, ptr, size, now());
+  return ptr;
+}
@@ -0,0 +1,61 @@
+/***************************************************************************
+ *  Title: Allocation Recordings
+ * -------------------------------------------------------------------------
+ *    Purpose: The file format of kma_record.so, the library that records
+ *             the malloc, free, realloc and calloc calls of a program it
+ *             is preloaded into. kma_trace turns a recording into a trace.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_RECORD_H__
+#define __KMA_RECORD_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// the first bytes of a recording
+#define KMA_RECORD_MAGIC "KMAREC01"
+
+// the op of a record. A realloc is a free of the old block and a
+// RECORD_REALLOC of the new one with the time of the call.
+#define RECORD_FREE 0
+#define RECORD_MALLOC 1
+#define RECORD_CALLOC 2
+#define RECORD_REALLOC 3
+
+typedef struct
+{
+  char magic[8];
+  int pid;
+  int record_size; // sizeof(kma_record_t) of the recording library
+} kma_record_header_t;
+
+// one call. Every thread writes whole buffers of records, so the records
+// of different threads are interleaved in the file and only the time
+// orders them. An allocation takes the time after the real call, a free
+// before it, so a block is always allocated before it is freed and freed
+// before its address comes back from another allocation.
+typedef struct
+{
+  unsigned long long time; // CLOCK_MONOTONIC in ns
+  unsigned long long ptr;
+  unsigned long long size; // 0 for a free
+  unsigned int tid;
+  unsigned int op;
+} kma_record_t;
+
+#endif /* __KMA_RECORD_H__ */
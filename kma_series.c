@@ -0,0 +1,87 @@
+/***************************************************************************
+ *  Title: Time Series Converter
+ * -------------------------------------------------------------------------
+ *    Purpose: Turns a series of kma_series.h (kma_output.ser and
+ *             kma_waste.ser of the harness) into the text gnuplot reads:
+ *             a line of the column names, then a line per sample
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_series.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  kma_series_header_t header;
+  long long sample[SERIES_COLUMNS];
+  FILE* in;
+  FILE* out;
+  long n = 0;
+  int i;
+
+  if (argc != 3)
+    {
+      printf("Usage: %s seriesFile textFile\n", argv[0]);
+      exit(0);
+    }
+  if ((in = fopen(argv[1], "rb")) == NULL)
+    error("unable to open input file", argv[1]);
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, KMA_SERIES_MAGIC, sizeof(header.magic)) != 0 ||
+      header.columns < 1 || header.columns > SERIES_COLUMNS)
+    error("not a series", argv[1]);
+  if ((out = fopen(argv[2], "w")) == NULL)
+    error("unable to open output file", argv[2]);
+
+  header.names[sizeof(header.names) - 1] = '\0';
+  fprintf(out, "# %s\n", header.names);
+  while (fread(sample, sizeof(long long), header.columns, in) ==
+	 header.columns)
+    {
+      for (i = 0; i < header.columns; i++)
+	fprintf(out, i ? " %lld" : "%lld", sample[i]);
+      fprintf(out, "\n");
+      n++;
+    }
+  fclose(in);
+  fclose(out);
+
+  printf("%s: %ld samples (windows of %d%s)\n", argv[2], n,
+	 header.interval, header.minmax ? ", min and max" : "");
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
@@ -0,0 +1,117 @@
+/***************************************************************************
+ *  Title: Lock-free Block Stacks
+ * -------------------------------------------------------------------------
+ *    Purpose: A stack of free blocks (Treiber stack) that threads push
+ *             and pop without a lock in the concurrent mode
+ *             (KMA_CONCURRENT). The head pointer carries a tag that
+ *             changes with every push and pop, so a pop that read an
+ *             old head fails its compare and swap even if the same
+ *             block is on top again (ABA)
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_STACK_H__
+#define __KMA_STACK_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma_lock.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// user space addresses fit in 48 bits, the tag uses the 16 bits above
+#define TAGSHIFT 48
+#define TAGPTR(h) ((void*)((h) & ((1UL << TAGSHIFT) - 1)))
+#define TAGNEXT(p, h) ((unsigned long)(p) | ((((h) >> TAGSHIFT) + 1) << TAGSHIFT))
+
+typedef struct
+{
+  unsigned long head; // the top block and its tag
+  int count;          // number of blocks, may be off by the pushes
+                      // and pops in progress
+} kma_stack_t;
+
+#define KMA_STACK_INITIALIZER { 0, 0 }
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Push a block
+ * ---------------------------------------------------------------------
+ *    Purpose: Push a free block, its first word links it to the next
+ *             one. A full stack (limit blocks) refuses the block
+ *    Input: the stack, the block, the most blocks the stack may hold
+ *    Output: TRUE if the block is on the stack
+ ***********************************************************************/
+static inline int
+kma_stack_push(kma_stack_t* stack, void* blk, int limit)
+{
+  if (kma_atomic_add(&stack->count, 1) > limit)
+    {
+      kma_atomic_add(&stack->count, -1);
+      return 0;
+    }
+#ifdef KMA_CONCURRENT
+  unsigned long old = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+  do
+    {
+      __atomic_store_n((void**)blk, TAGPTR(old), __ATOMIC_RELAXED);
+    }
+  while (!__atomic_compare_exchange_n(&stack->head, &old, TAGNEXT(blk, old), 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#else
+  *(void**)blk = TAGPTR(stack->head);
+  stack->head = TAGNEXT(blk, stack->head);
+#endif
+  return 1;
+}
+
+/***********************************************************************
+ *  Title: Pop a block
+ * ---------------------------------------------------------------------
+ *    Purpose: Take the top block. The next pointer of a block another
+ *             thread took in the meantime may be anything, but then
+ *             the tag has changed and we try again. Blocks must stay
+ *             readable while threads may pop (their pages stay in the
+ *             pool while blocks are given out)
+ *    Input: the stack
+ *    Output: the block, or NULL if the stack is empty
+ ***********************************************************************/
+static inline void*
+kma_stack_pop(kma_stack_t* stack)
+{
+  void* blk;
+#ifdef KMA_CONCURRENT
+  unsigned long old = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+  do
+    {
+      blk = TAGPTR(old);
+      if (blk == NULL)
+        return NULL;
+    }
+  while (!__atomic_compare_exchange_n(&stack->head, &old,
+                                      TAGNEXT(__atomic_load_n((void**)blk, __ATOMIC_RELAXED), old),
+                                      1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+#else
+  blk = TAGPTR(stack->head);
+  if (blk == NULL)
+    return NULL;
+  stack->head = TAGNEXT(*(void**)blk, stack->head);
+#endif
+  kma_atomic_add(&stack->count, -1);
+  return blk;
+}
+
+#endif /* __KMA_STACK_H__ */
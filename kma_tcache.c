@@ -0,0 +1,324 @@
+/***************************************************************************
+ *  Title: Thread Caches
+ * -------------------------------------------------------------------------
+ *    Purpose: Per-thread caches of free blocks in front of any of the
+ *             allocators (KMA_TCACHE). With KMA_TCACHE the allocator
+ *             is built as kma_backend_malloc/kma_backend_free (see
+ *             kma.h) and this file is kma_malloc/kma_free.
+ *             Every page records the thread whose cache last got
+ *             blocks from it, a block freed by another thread goes to
+ *             a remote-free list of that thread, which takes the whole
+ *             list on its next miss (like the thread free lists of
+ *             mimalloc)
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifdef KMA_TCACHE
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_lock.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+#define TCCLASSES 9 //classes of 8 to 4088 bytes
+#define TCDEPTH 16 //blocks a class keeps by default
+#define TCTHREADS 128 //threads that own pages at the same time
+//class k holds blocks of TCSIZE(k) bytes, one pointer less than a power
+//of two: the power-of-two allocators round that up to the power of two
+//with their block header, so the cache does not waste more than they do
+#define TCSIZE(k) ((16 << (k)) - (int)sizeof(void*))
+
+//free blocks of one class, linked through their first word
+typedef struct {
+  void* head;
+  int count;
+} tc_bin_t;
+
+typedef struct {
+  tc_bin_t bin[TCCLASSES];
+  //blocks of the classes this thread got minus the ones it freed
+  int live;
+  long hits;
+  long misses;
+  //blocks taken from the remote-free lists
+  long remote;
+  bool registered;
+  //our slot for the remote-free lists + 1, 0 if we have none
+  int slot;
+} tcache_t;
+
+/************Global Variables*********************************************/
+//the cache of this thread, a hit touches nothing else
+static __thread tcache_t tcache;
+//blocks a class keeps, 0 turns the caches off
+static int depth = TCDEPTH;
+//remote frees on or off (off, a block goes to the cache of the thread
+//that frees it)
+static int remote_frees = TRUE;
+//counts of the threads that are gone
+static long gone_hits = 0;
+static long gone_misses = 0;
+static long gone_remote = 0;
+static kma_lock_t stats_lock = KMA_LOCK_INITIALIZER;
+#ifdef KMA_CONCURRENT
+//a thread that exits drains its cache
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+#endif
+//the slot + 1 of the thread whose cache last got blocks from a page
+static int page_owner[MAXPAGES];
+//a slot belongs to a thread while it is TRUE
+static int slot_used[TCTHREADS];
+//the remote-free list of every slot and class. any thread pushes,
+//only whole lists are taken, so there is no ABA to care about.
+static void* remote_list[TCTHREADS][TCCLASSES];
+/************Function Prototypes******************************************/
+int tc_class(kma_size_t);
+void* tc_refill(int);
+void* tc_own(void*);
+void tc_flush(int, int);
+void tc_drain();
+void remote_push(int, int, void*);
+void* remote_take(int, int);
+void remote_release(int);
+void tc_register();
+#ifdef KMA_CONCURRENT
+void tc_make_key();
+#endif
+void tc_exit(void*);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+//the class of a size, TCSIZE(k - 1) < size <= TCSIZE(k)
+int tc_class(kma_size_t size) {
+  int k = 28 - __builtin_clz(size + sizeof(void*) - 1);
+  return k < 0 ? 0 : k;
+}
+
+void* kma_malloc(kma_size_t size) {
+  if (size > TCSIZE(TCCLASSES - 1) || depth == 0)
+    return kma_backend_malloc(size);
+
+  int k = tc_class(size);
+  tc_bin_t* bin = &tcache.bin[k];
+  tcache.live++;
+  if (bin->head == NULL)
+    return tc_refill(k);
+  void* blk = bin->head;
+  bin->head = *(void**)blk;
+  bin->count--;
+  tcache.hits++;
+  return blk;
+}
+//a miss takes the blocks other threads freed for us first. if there
+//are none, it gets half the depth of blocks from the backend at once,
+//returns the first one and keeps the others.
+void* tc_refill(int k) {
+  tc_bin_t* bin = &tcache.bin[k];
+  int n = (depth + 1) / 2;
+  void* blk;
+
+  if (!tcache.registered)
+    tc_register();
+  tcache.misses++;
+  if (tcache.slot && (blk = remote_take(tcache.slot - 1, k)) != NULL) {
+    //keep the rest of the list up to the depth
+    void* next = *(void**)blk;
+    tcache.remote++;
+    while (next) {
+      void* cur = next;
+      next = *(void**)cur;
+      tcache.remote++;
+      if (bin->count < depth) {
+        *(void**)cur = bin->head;
+        bin->head = cur;
+        bin->count++;
+      }
+      else
+        kma_backend_free(cur, TCSIZE(k));
+    }
+    return blk;
+  }
+  while (--n > 0) {
+    blk = tc_own(kma_backend_malloc(TCSIZE(k)));
+    *(void**)blk = bin->head;
+    bin->head = blk;
+    bin->count++;
+  }
+  return tc_own(kma_backend_malloc(TCSIZE(k)));
+}
+//we own the page of a block we got from the backend now
+void* tc_own(void* blk) {
+  int* owner = &page_owner[PAGEINDEX(blk)];
+  //do not write the line if nothing changes
+  if (tcache.slot && kma_atomic_load(owner) != tcache.slot)
+    kma_atomic_store(owner, tcache.slot);
+  return blk;
+}
+
+void kma_free(void* ptr, kma_size_t size) {
+  if (size > TCSIZE(TCCLASSES - 1) || depth == 0) {
+    kma_backend_free(ptr, size);
+    return;
+  }
+
+  int k = tc_class(size);
+  tc_bin_t* bin = &tcache.bin[k];
+  int owner = kma_atomic_load(&page_owner[PAGEINDEX(ptr)]);
+  //a thread may only free blocks, it still has to drain when it exits
+  if (!tcache.registered)
+    tc_register();
+  if (remote_frees && owner && owner != tcache.slot)
+    remote_push(owner - 1, k, ptr);
+  else {
+    *(void**)ptr = bin->head;
+    bin->head = ptr;
+    //a full class gives half of its blocks back at once
+    if (++bin->count > depth)
+      tc_flush(k, bin->count - depth / 2);
+  }
+  //the backends free their pages when all blocks are back,
+  //so a thread with no blocks left lets its cache go
+  if (--tcache.live == 0)
+    tc_drain();
+}
+//give n blocks of class k back to the backend
+void tc_flush(int k, int n) {
+  tc_bin_t* bin = &tcache.bin[k];
+  while (n-- > 0 && bin->head) {
+    void* blk = bin->head;
+    bin->head = *(void**)blk;
+    bin->count--;
+    kma_backend_free(blk, TCSIZE(k));
+  }
+}
+//give all cached blocks of this thread back, with the ones other
+//threads freed for us
+void tc_drain() {
+  int k;
+  for (k = 0; k < TCCLASSES; k++)
+    tc_flush(k, tcache.bin[k].count);
+  if (tcache.slot)
+    remote_release(tcache.slot - 1);
+}
+//push a block on the remote-free list of class k of a slot. if the
+//thread of the slot is gone (or going, it clears slot_used before it
+//takes its lists), nobody would take the list, so we give it back.
+void remote_push(int slot, int k, void* blk) {
+  void** list = &remote_list[slot][k];
+#ifdef KMA_CONCURRENT
+  void* old = __atomic_load_n(list, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n((void**)blk, old, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(list, &old, blk, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+#else
+  *(void**)blk = *list;
+  *list = blk;
+#endif
+  if (!kma_atomic_load(&slot_used[slot]))
+    remote_release(slot);
+}
+//take the whole remote-free list of class k of a slot
+void* remote_take(int slot, int k) {
+  void** list = &remote_list[slot][k];
+#ifdef KMA_CONCURRENT
+  if (__atomic_load_n(list, __ATOMIC_RELAXED) == NULL)
+    return NULL;
+  return __atomic_exchange_n(list, NULL, __ATOMIC_SEQ_CST);
+#else
+  void* blk = *list;
+  *list = NULL;
+  return blk;
+#endif
+}
+//give the remote-free lists of a slot back to the backend
+void remote_release(int slot) {
+  int k;
+  for (k = 0; k < TCCLASSES; k++) {
+    void* blk = remote_take(slot, k);
+    while (blk) {
+      void* next = *(void**)blk;
+      kma_backend_free(blk, TCSIZE(k));
+      blk = next;
+    }
+  }
+}
+
+#ifdef KMA_CONCURRENT
+void tc_make_key() {
+  pthread_key_create(&exit_key, tc_exit);
+}
+#endif
+//make sure the cache is drained when the thread exits (KMA_CONCURRENT),
+//the key only needs a value that is not NULL. we take a free slot for
+//the remote-free lists, without one the pages we get stay unowned.
+void tc_register() {
+  int i;
+#ifdef KMA_CONCURRENT
+  pthread_once(&exit_once, tc_make_key);
+  pthread_setspecific(exit_key, &tcache);
+#endif
+  tcache.registered = TRUE;
+  for (i = 0; i < TCTHREADS && !tcache.slot; i++) {
+    if (kma_atomic_cas(&slot_used[i], FALSE, TRUE))
+      tcache.slot = i + 1;
+  }
+}
+//the cache and the remote-free lists go back to the backend,
+//the counts to the totals
+void tc_exit(void* arg) {
+  tc_drain();
+  if (tcache.slot) {
+    kma_atomic_store(&slot_used[tcache.slot - 1], FALSE);
+    remote_release(tcache.slot - 1);
+    tcache.slot = 0;
+  }
+  kma_lock(&stats_lock);
+  gone_hits += tcache.hits;
+  gone_misses += tcache.misses;
+  gone_remote += tcache.remote;
+  kma_unlock(&stats_lock);
+  tcache.hits = 0;
+  tcache.misses = 0;
+  tcache.remote = 0;
+  tcache.registered = FALSE;
+}
+
+void kma_tcache_depth(int n) {
+  depth = n;
+}
+
+void kma_tcache_remote(bool on) {
+  remote_frees = on;
+}
+
+void kma_tcache_stats(long* hits, long* misses, long* remote) {
+  kma_lock(&stats_lock);
+  *hits = gone_hits + tcache.hits;
+  *misses = gone_misses + tcache.misses;
+  *remote = gone_remote + tcache.remote;
+  kma_unlock(&stats_lock);
+}
+
+#endif // KMA_TCACHE
@@ -0,0 +1,364 @@
+/***************************************************************************
+ *  Title: Trace Converter
+ * -------------------------------------------------------------------------
+ *    Purpose: Converts a text trace into the binary format of
+ *             kma_trace.h, which the test harness maps instead of
+ *             parsing it, and a recording of kma_record.so into a
+ *             trace of either format
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+#include "kma_record.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// an entry of the table of live blocks, ptr 0 is empty
+typedef struct
+{
+  unsigned long long ptr;
+  int id;
+} live_t;
+
+/************Global Variables*********************************************/
+
+// the records of a recording, for sorting them by time
+static kma_record_t* records = NULL;
+
+// the live blocks by address, open addressing with linear probing
+static live_t* live = NULL;
+static unsigned long live_mask = 0;
+static long n_live = 0;
+
+/************Function Prototypes******************************************/
+trace_t* read_recording(char*);
+void write_text(char*, trace_t*);
+void write_binary(char*, trace_t*);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int text = 0;
+  char magic[8];
+  FILE* in;
+  trace_t* trace;
+
+  if (argc == 4 && strcmp(argv[1], "-t") == 0)
+    {
+      text = 1;
+      argv++;
+      argc--;
+    }
+  if (argc != 3)
+    {
+      printf("Usage: %s [-t] inputFile outputTrace\n", argv[0]);
+      printf("       the input is a text trace or a recording of "
+	     "kma_record.so, the\n"
+	     "       output a binary trace (a text trace with -t)\n");
+      exit(0);
+    }
+
+  if ((in = fopen(argv[1], "r")) == NULL)
+    error("unable to open input file", argv[1]);
+  if (fread(magic, sizeof(magic), 1, in) == 1 &&
+      memcmp(magic, KMA_RECORD_MAGIC, sizeof(magic)) == 0)
+    {
+      fclose(in);
+      trace = read_recording(argv[1]);
+    }
+  else
+    {
+      fclose(in);
+      trace = read_trace(argv[1]);
+    }
+
+  if (text)
+    write_text(argv[2], trace);
+  else
+    write_binary(argv[2], trace);
+
+  printf("%s: %d requests, %d operations\n", argv[2], trace->n_req,
+	 trace->n_ops);
+  return 0;
+}
+
+static unsigned long
+hash(unsigned long long ptr)
+{
+  return (ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 20;
+}
+
+// the slot of ptr, or the empty slot where it goes
+static live_t*
+live_find(unsigned long long ptr)
+{
+  unsigned long i = hash(ptr) & live_mask;
+
+  while (live[i].ptr != 0 && live[i].ptr != ptr)
+    i = (i + 1) & live_mask;
+  return &live[i];
+}
+
+static void
+live_grow()
+{
+  live_t* old = live;
+  unsigned long i, n = live_mask + 1;
+
+  live_mask = live ? 2 * n - 1 : 1023;
+  live = calloc(live_mask + 1, sizeof(live_t));
+  if (live == NULL)
+    error("out of memory", "live blocks");
+  for (i = 0; old && i < n; i++)
+    if (old[i].ptr)
+      *live_find(old[i].ptr) = old[i];
+  free(old);
+}
+
+// empty a slot and move the entries after it that belong before it
+static void
+live_remove(live_t* slot)
+{
+  unsigned long i = slot - live, j = i, k;
+
+  live[i].ptr = 0;
+  n_live--;
+  for (;;)
+    {
+      j = (j + 1) & live_mask;
+      if (live[j].ptr == 0)
+	return;
+      k = hash(live[j].ptr) & live_mask;
+      // the entry stays if its home lies cyclically in (i, j]
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+	continue;
+      live[i] = live[j];
+      live[j].ptr = 0;
+      i = j;
+    }
+}
+
+static void
+add_op(trace_t* trace, int* max_ops, int op, int id, int size)
+{
+  kma_trace_op_t* o;
+
+  if (trace->n_ops == *max_ops)
+    {
+      *max_ops *= 2;
+      trace->ops = realloc(trace->ops, *max_ops * sizeof(kma_trace_op_t));
+      if (trace->ops == NULL)
+	error("out of memory", "operations");
+    }
+  o = &trace->ops[trace->n_ops++];
+  o->op = op;
+  o->id = id;
+  o->size = size;
+}
+
+// by time, and by the order in the file where the time is the same
+static int
+by_time(const void* a, const void* b)
+{
+  const kma_record_t* x = &records[*(const long*) a];
+  const kma_record_t* y = &records[*(const long*) b];
+
+  if (x->time != y->time)
+    return x->time < y->time ? -1 : 1;
+  return *(const long*) a < *(const long*) b ? -1 :
+    *(const long*) a > *(const long*) b;
+}
+
+// the calls of a recording in time order, as a trace. Every block gets
+// the lowest request id free at the time, so the trace needs as many
+// ids as blocks were live at once. A free of an address that is not
+// live (allocated before the recording started, or through a call the
+// recorder does not see) is dropped, an allocation at a live address
+// frees the block the recorder missed the free of first, and the blocks
+// live at the end are freed at the end.
+trace_t*
+read_recording(char* file)
+{
+  FILE* in;
+  struct stat st;
+  kma_record_header_t header;
+  long i, n, *order;
+  long unknown = 0, missed = 0, clamped = 0, n_threads = 0, max_live = 0;
+  int max_ops, n_free_ids = 0, *free_ids;
+  unsigned int* tids;
+  trace_t* trace;
+
+  if ((in = fopen(file, "r")) == NULL || fstat(fileno(in), &st) != 0 ||
+      fread(&header, sizeof(header), 1, in) != 1)
+    error("unable to read", file);
+  if (header.record_size != sizeof(kma_record_t))
+    error("recording of another record format", file);
+  n = (st.st_size - sizeof(header)) / sizeof(kma_record_t);
+
+  char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if (map == MAP_FAILED)
+    error("unable to map", file);
+  fclose(in);
+  records = (kma_record_t*) (map + sizeof(header));
+
+  order = malloc(n * sizeof(long));
+  tids = malloc(n * sizeof(unsigned int));
+  free_ids = malloc(n * sizeof(int));
+  if (n > 0 && (order == NULL || tids == NULL || free_ids == NULL))
+    error("out of memory", "records");
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  qsort(order, n, sizeof(long), by_time);
+
+  trace = malloc(sizeof(trace_t));
+  trace->n_req = 0;
+  trace->n_ops = 0;
+  max_ops = 1024;
+  trace->ops = malloc(max_ops * sizeof(kma_trace_op_t));
+  live_grow();
+
+  for (i = 0; i < n; i++)
+    {
+      kma_record_t* r = &records[order[i]];
+      live_t* slot = live_find(r->ptr);
+      long t;
+
+      // threads, for the summary
+      if (i == 0 || r->tid != records[order[i - 1]].tid)
+	{
+	  for (t = 0; t < n_threads && tids[t] != r->tid; t++)
+	    ;
+	  if (t == n_threads)
+	    tids[n_threads++] = r->tid;
+	}
+
+      if (r->op == RECORD_FREE)
+	{
+	  if (slot->ptr == 0)
+	    {
+	      unknown++;
+	      continue;
+	    }
+	  add_op(trace, &max_ops, TRACE_FREE, slot->id, 0);
+	  free_ids[n_free_ids++] = slot->id;
+	  live_remove(slot);
+	  continue;
+	}
+
+      if (slot->ptr != 0)
+	{
+	  missed++;
+	  add_op(trace, &max_ops, TRACE_FREE, slot->id, 0);
+	  free_ids[n_free_ids++] = slot->id;
+	  live_remove(slot);
+	  slot = live_find(r->ptr);
+	}
+      if (2 * (n_live + 1) > live_mask)
+	{
+	  live_grow();
+	  slot = live_find(r->ptr);
+	}
+
+      // the harness has no empty requests, malloc(0) is a block too
+      int size = r->size;
+      if (r->size == 0 || r->size > 0x7fffffff)
+	{
+	  clamped++;
+	  size = r->size == 0 ? 1 : 0x7fffffff;
+	}
+      slot->ptr = r->ptr;
+      slot->id = n_free_ids > 0 ? free_ids[--n_free_ids] : trace->n_req++;
+      n_live++;
+      if (n_live > max_live)
+	max_live = n_live;
+      add_op(trace, &max_ops, TRACE_REQUEST, slot->id, size);
+    }
+
+  long leaked = n_live;
+  for (i = 0; i <= live_mask; i++)
+    if (live[i].ptr)
+      add_op(trace, &max_ops, TRACE_FREE, live[i].id, 0);
+
+  printf("%s: %ld records of %ld threads (pid %d)\n", file, n, n_threads,
+	 header.pid);
+  printf("  %ld frees of unknown blocks dropped, %ld missed frees added, "
+	 "%ld blocks freed at the end\n", unknown, missed, leaked);
+  printf("  %ld sizes of 0 or more than 2 GB changed, "
+	 "%ld blocks live at most\n", clamped, max_live);
+
+  munmap(map, st.st_size);
+  free(order);
+  free(tids);
+  free(free_ids);
+  return trace;
+}
+
+void
+write_text(char* file, trace_t* trace)
+{
+  FILE* out = fopen(file, "w");
+  int i;
+
+  if (out == NULL)
+    error("unable to open output file", file);
+  fprintf(out, "%d\n", trace->n_req);
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      kma_trace_op_t* op = &trace->ops[i];
+
+      if (op->op == TRACE_REQUEST)
+	fprintf(out, "REQUEST %d %d\n", op->id, op->size);
+      else
+	fprintf(out, "FREE %d\n", op->id);
+    }
+  if (fclose(out) != 0)
+    error("unable to write", file);
+}
+
+void
+write_binary(char* file, trace_t* trace)
+{
+  kma_trace_header_t header;
+
+  memcpy(header.magic, KMA_TRACE_MAGIC, sizeof(header.magic));
+  header.n_req = trace->n_req;
+  header.n_ops = trace->n_ops;
+
+  FILE* out = fopen(file, "w");
+  if (out == NULL)
+    error("unable to open output file", file);
+  if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+      fwrite(trace->ops, sizeof(kma_trace_op_t), header.n_ops, out) !=
+      header.n_ops ||
+      fclose(out) != 0)
+    error("unable to write", file);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
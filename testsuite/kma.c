@@ -60,10 +60,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_trace.h"
+#include "kma_verify.h"
+#ifndef COMPETITION
+#include "kma_series.h"
+#endif
+#ifdef KMA_LATENCY
+#include "kma_latency.h"
+#endif
+#ifdef KMA_CONCURRENT
+#include "kma_lock.h"
+#endif
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -82,23 +99,61 @@ typedef struct mem
 {
   int size;
   void* ptr;
-  void* value; // to check correctness
   enum REQ_STATE state;
 } mem_t;
 
+#ifdef KMA_CONCURRENT
+// blocks on their way from a producer to its consumer with -c
+#define RINGSIZE 256
+
+typedef struct
+{
+  void* ptr[RINGSIZE];
+  int size[RINGSIZE];
+  unsigned int head; // next slot the consumer takes
+  unsigned int tail; // next slot the producer fills
+} ring_t;
+
+typedef struct
+{
+  pthread_t thread;
+  int id;
+  trace_t* trace; // NULL for alloc/free pairs
+  ring_t* ring; // shared by a producer and its consumer with -c
+  long n_ops;
+  double seconds;
+  long locks; // kma_lock calls while the clock ran
+  long contended; // the ones that had to wait
+} worker_t;
+#endif
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+// with -v k only 1 in k blocks are filled and checked whole, the others
+// at their edges (kma_verify.h)
+static int verifyEvery = 1;
 
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void check(mem_t*, int);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+#ifdef KMA_CONCURRENT
+int concurrent_main(int, char*[]);
+trace_t* shard_trace(trace_t*, int, int);
+void fill_pattern(char*, int, int);
+void check_pattern(char*, int, int);
+double start_clock(worker_t*);
+void stop_clock(worker_t*, double, long);
+void* replay(void*);
+void* pairs(void*);
+void* producer(void*);
+void* consumer(void*);
+double now();
+#endif
 
 /************External Declaration*****************************************/
 
@@ -118,6 +173,10 @@ main(int argc, char* argv[])
   
   name = argv[0];
   
+#ifdef KMA_CONCURRENT
+  return concurrent_main(argc, argv);
+#endif
+
 #ifdef COMPETITION
   printf("%s: Running in competition mode\n", name);
 #endif
@@ -126,7 +185,7 @@ main(int argc, char* argv[])
   printf("%s: Running in correctness mode\n", name);
 #endif
 
-  int n_req = 0, n_alloc=0, n_dealloc=0;
+  int n_req = 0, n_alloc=0, n_dealloc=0, opt;
   kma_page_stat_t* stat;
 
 #ifdef COMPETITION
@@ -134,74 +193,132 @@ main(int argc, char* argv[])
   int ratioCount = 0;
 #endif
   
-#ifndef COMPETITION
-  FILE* allocTrace = fopen("kma_output.dat", "w");
-  if (allocTrace == NULL)
+  // -i keeps one sample of the curves every interval operations, -m
+  // the smallest and largest allocation of the interval too. The
+  // resident pool is looked at every rssEvery operations (-r).
+  int interval = 1, minmax = FALSE, rssEvery = 1000;
+
+  while ((opt = getopt(argc, argv, "i:mv:r:")) != -1)
     {
-      error("unable to open allocation output file", "kma_output.dat");
+      switch (opt)
+	{
+	case 'i':
+	  interval = atoi(optarg);
+	  break;
+	case 'm':
+	  minmax = TRUE;
+	  break;
+	case 'v':
+	  verifyEvery = atoi(optarg);
+	  break;
+	case 'r':
+	  rssEvery = atoi(optarg);
+	  break;
+	default:
+	  usage();
+	}
     }
-  fprintf(allocTrace, "0 0 0\n");
+  if (argc - optind != 1 || interval < 1 || verifyEvery < 1 || rssEvery < 1)
+    {
+      usage();
+    }
+#ifdef COMPETITION
+  // there are no curves to sample
+  (void) minmax;
+  (void) rssEvery;
 #endif
 
-  if (argc != 2)
+#ifndef COMPETITION
+  // the curves go to binary files, kma_series turns them into the
+  // kma_output.dat and kma_waste.dat of kma_output.plt
+  long long sample[5] = { 0, 0, 0, 0, 0 };
+  series_t* allocTrace = series_open("kma_output.ser",
+				     "index requested allocated",
+				     interval, minmax, 2);
+  if (allocTrace == NULL)
     {
-      usage();
+      error("unable to open allocation output file", "kma_output.ser");
     }
-  
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+  series_add(allocTrace, sample);
+
+  // the bytes of the pool in memory and the minor faults since the
+  // start, against the bytes allocated
+  long long rss[4] = { 0, 0, 0, 0 };
+  long peakResident = 0, faults = minor_faults();
+  series_t* rssTrace = series_open("kma_rss.ser",
+				   "index allocated resident faults",
+				   1, FALSE, 0);
+  if (rssTrace == NULL)
     {
-      error("unable to open input test file", argv[1]);
+      error("unable to open resident output file", "kma_rss.ser");
     }
+  series_add(rssTrace, rss);
+#endif
+
+#ifdef KMA_WASTE
+  // where the waste of kma_output.ser goes, by operation
+  kma_waste_t waste;
+  double wasteSum[4] = { 0.0, 0.0, 0.0, 0.0 };
+  series_t* wasteTrace = series_open("kma_waste.ser",
+				     "index header free rounding other",
+				     interval, minmax, -1);
+  if (wasteTrace == NULL)
+    {
+      error("unable to open waste output file", "kma_waste.ser");
+    }
+  series_add(wasteTrace, sample);
+#endif
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  // Read the whole trace (text or binary) before the replay
+  trace_t* trace = read_trace(argv[optind]);
+  n_req = trace->n_req;
   
   mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
   memset(requests, 0, (n_req + 1)*sizeof(mem_t));
   
-  char command[16];
-  int req_id, req_size, index = 1;
+  int i, req_id, index = 1;
+
+#ifdef KMA_LATENCY
+  lat_init();
+#endif
 
-  // Parse the lines in the file, and call allocate or
+  // Replay the operations, and call allocate or
   // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
+  for (i = 0; i < trace->n_ops; i++)
     {
-      if (strcmp(command, "REQUEST") == 0)
+      kma_trace_op_t* op = &trace->ops[i];
+      
+      req_id = op->id;
+      if (op->op == TRACE_REQUEST)
 	{
-	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  allocate(requests, req_id, req_size);
+	  allocate(requests, req_id, op->size);
 	  n_alloc++;
 	}
-      else if (strcmp(command, "FREE") == 0)
+      else
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
+#ifndef COMPETITION
+	  // the pool goes when its last page comes back, and the resident
+	  // bytes only go down with it
+	  if (requests[req_id].ptr != NULL &&
+	      currentAllocBytes == requests[req_id].size)
+	    {
+	      long resident = pool_resident();
+
+	      if (resident > peakResident)
+		peakResident = resident;
+	    }
+#endif
 	  deallocate(requests, req_id);
 	  n_dealloc++;
 	}
-      else
-	{
-	  error("unknown command type:", command);
-	}
 
-      stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
+      int totalBytes = pages_in_use() * PAGESIZE;
 
       
 #ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      // refused requests do not count, skip the points where only
+      // refused requests are pending
+      if(req_id < n_req && n_alloc != n_dealloc && currentAllocBytes > 0)
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
@@ -212,14 +329,58 @@ main(int argc, char* argv[])
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      sample[0] = index;
+      sample[1] = currentAllocBytes;
+      sample[2] = totalBytes;
+      series_add(allocTrace, sample);
+
+      if (index % rssEvery == 0)
+	{
+	  rss[0] = index;
+	  rss[1] = totalBytes;
+	  rss[2] = pool_resident();
+	  rss[3] = minor_faults() - faults;
+	  series_add(rssTrace, rss);
+	  if (rss[2] > peakResident)
+	    peakResident = rss[2];
+	}
+#endif
+
+#ifdef KMA_WASTE
+      // other is what the allocator does not count, it should be 0
+      kma_waste(&waste);
+      long other = totalBytes - currentAllocBytes - waste.rounding -
+	waste.free - waste.header;
+      sample[1] = waste.header;
+      sample[2] = waste.free;
+      sample[3] = waste.rounding;
+      sample[4] = other;
+      series_add(wasteTrace, sample);
+      wasteSum[0] += waste.rounding;
+      wasteSum[1] += waste.free;
+      wasteSum[2] += waste.header;
+      wasteSum[3] += other;
 #endif
       
       index += 1;
     }
 
 #ifndef COMPETITION
-  fclose(allocTrace);
+  series_close(allocTrace);
+  series_close(rssTrace);
+  printf("Peak resident pool (bytes): %ld, minor faults: %ld\n",
+	 peakResident, minor_faults() - faults);
+#endif
+
+#ifdef KMA_WASTE
+  series_close(wasteTrace);
+  printf("Average waste (bytes): rounding %.0f, free %.0f, header %.0f, "
+	 "other %.0f\n", wasteSum[0] / trace->n_ops, wasteSum[1] / trace->n_ops,
+	 wasteSum[2] / trace->n_ops, wasteSum[3] / trace->n_ops);
+#endif
+
+#ifdef KMA_LATENCY
+  lat_report("kma_latency.json");
 #endif
   
   
@@ -262,7 +423,8 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-i interval] [-m] [-v k] [-r rssEvery] traceFile\n",
+	 name);
   exit(0);
 }
 
@@ -280,11 +442,17 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
   
   new->size = req_size;
+#ifdef KMA_LATENCY
+  kma_tick_t start = lat_now();
   new->ptr = kma_malloc(new->size);
+  lat_record(LAT_MALLOC, new->size, start);
+#else
+  new->ptr = kma_malloc(new->size);
+#endif
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response for requests larger than a page, an
+  // allocator may still serve them from contiguous pages
+  if ((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
@@ -297,20 +465,10 @@ allocate(mem_t* requests, int req_id, int req_size)
   currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
-  // testing for correctness.
-  
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
-  
-  // initialize memory
-  fill((char*)new->ptr, new->size);
-  
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
-  
-  check((char*)new->ptr, (char*)new->value, new->size);
-  
+  // Only run the actual memory accesses/checks if we're testing for
+  // correctness. The pattern comes from the request id, a block that
+  // overlaps this one is caught when it is checked.
+  verify_fill((char*)new->ptr, new->size, req_id, verifyEvery);
 #endif
 
   new->state = USED;
@@ -321,49 +479,533 @@ deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
   
+  // the allocator turned the request down, nothing to free
+  if (cur->state == FREE && cur->ptr == NULL)
+    {
+      return;
+    }
+  
   assert(cur->state == USED);
   assert(cur->size > 0);
   
 #ifndef COMPETITION
   // Only run the memory checks if we're testing for correctness.
-
-  // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
-
-  // free memory
-  free(cur->value);
+  check(requests, req_id);
 #endif
 
+#ifdef KMA_LATENCY
+  kma_tick_t start = lat_now();
+  kma_free(cur->ptr, cur->size);
+  lat_record(LAT_FREE, cur->size, start);
+#else
   kma_free(cur->ptr, cur->size);
+#endif
 
   currentAllocBytes -= cur->size;
   
   cur->state = FREE;
 }
 
+// check a block against the pattern of its request id
 void
-fill(char* ptr, int size)
+check(mem_t* requests, int req_id)
 {
+  mem_t* cur = &requests[req_id];
+  int bad = verify_check((char*)cur->ptr, cur->size, req_id, verifyEvery);
+
+  if (bad >= 0)
+    {
+      fprintf(stderr, "memory mismatch in request %d at position %d\n",
+	      req_id, bad);
+      anyMismatches = 1;
+    }
+}
+
+#ifdef KMA_CONCURRENT
+/***************************************************************************
+ * Concurrent mode: every thread replays a trace with its own requests
+ * table (thread t gets trace t modulo the number of traces) against the
+ * shared allocator. With -s and one trace, the trace is sharded by
+ * request id instead: thread t replays the requests whose id modulo the
+ * number of threads is t. The threads start together at a barrier and
+ * only the replay is timed, so the throughput of 1, 2, 4... threads
+ * shows how the allocator scales with cores. Instead of a copy of every
+ * block, the request id is written to the first and last int of a block
+ * and checked when it is freed, which catches blocks handed to two
+ * threads at once. -f fills and checks every byte with a pattern made
+ * from the id. Every thread prints its throughput and the locks it took
+ * and had to wait for (the kma_lock counts).
+ *
+ * With -p the threads do alloc/free pairs instead of a trace, which is
+ * the stress test and the benchmark of the lock-free paths. With thread
+ * caches (KMA_TCACHE) -d sets their depth and the hit rate is printed.
+ * With magazines (KMA_MAGAZINE) -d sets the blocks a magazine starts
+ * with, and all cached blocks go back to the allocator before the pages
+ * are counted.
+ *
+ * With -c the even threads are producers that allocate blocks and hand
+ * them through a ring to the next thread, which checks and frees them.
+ * Every block is freed by a thread that did not allocate it, which is
+ * the case of the remote-free lists of the thread caches (-R turns them
+ * off). The main thread samples the pages in use while they run, so
+ * the peak shows whether the memory stays bounded. Per-thread heaps
+ * (KMA_HEAP) need the owner to free a block, so they cannot run -c.
+ ***************************************************************************/
+
+static pthread_barrier_t start_barrier;
+
+// alloc/free pairs every thread does with -p
+static long n_pairs = 0;
+
+// blocks a thread keeps allocated with -p
+#define LIVEPAIRS 16
+
+// blocks every producer hands over with -c
+static long n_items = 0;
+
+// threads that are done, the main thread samples the pages until all are
+static int n_done = 0;
+
+// check every byte of a block with -f
+static int full_check = FALSE;
+
+int
+concurrent_main(int argc, char* argv[])
+{
+  int i, opt, n_threads = 0, n_traces = 0, shard = FALSE;
+  long n_ops = 0, locks = 0, contended = 0;
+  double elapsed = 0.0;
+  int peak = 0;
+  kma_page_stat_t* stat;
+  trace_t** traces = NULL;
+  ring_t* rings = NULL;
+  
+  while ((opt = getopt(argc, argv, "p:c:sfd:R")) != -1)
+    {
+      switch (opt)
+	{
+	case 's':
+	  shard = TRUE;
+	  break;
+	case 'f':
+	  full_check = TRUE;
+	  break;
+	case 'p':
+	  n_pairs = atol(optarg);
+	  break;
+	case 'c':
+	  n_items = atol(optarg);
+	  break;
+#ifdef KMA_TCACHE
+	case 'd':
+	  kma_tcache_depth(atoi(optarg));
+	  break;
+	case 'R':
+	  kma_tcache_remote(FALSE);
+	  break;
+#endif
+#ifdef KMA_MAGAZINE
+	case 'd':
+	  kma_magazine_size(atoi(optarg));
+	  break;
+#endif
+	default:
+	  n_pairs = -1;
+	}
+    }
+  if (optind < argc)
+    {
+      n_threads = atoi(argv[optind]);
+      n_traces = argc - optind - 1;
+    }
+  if (n_threads < 1 || n_pairs < 0 || n_items < 0 ||
+      (n_pairs > 0) + (n_items > 0) + (n_traces > 0) != 1 ||
+      (n_items > 0 && n_threads % 2 != 0) || (shard && n_traces != 1))
+    {
+#ifdef KMA_TCACHE
+      printf("Usage: %s [-d depth] [-R] [-f] threads traceFile [traceFile...]\n",
+	     name);
+      printf("       %s [-d depth] [-R] [-f] -s threads traceFile\n", name);
+      printf("       %s [-d depth] [-R] -p pairs threads\n", name);
+      printf("       %s [-d depth] [-R] -c items threads (even)\n", name);
+#elif defined(KMA_MAGAZINE)
+      printf("Usage: %s [-d rounds] [-f] threads traceFile [traceFile...]\n",
+	     name);
+      printf("       %s [-d rounds] [-f] -s threads traceFile\n", name);
+      printf("       %s [-d rounds] -p pairs threads\n", name);
+      printf("       %s [-d rounds] -c items threads (even)\n", name);
+#else
+      printf("Usage: %s [-f] threads traceFile [traceFile...]\n", name);
+      printf("       %s [-f] -s threads traceFile\n", name);
+      printf("       %s -p pairs threads\n", name);
+      printf("       %s -c items threads (even)\n", name);
+#endif
+      exit(0);
+    }
+#ifdef KMA_HEAP
+  if (n_items > 0)
+    error("per-thread heaps cannot free blocks of other threads", "-c");
+#endif
+  printf("%s: Running in concurrent mode with %d threads\n", name, n_threads);
+  
+  if (n_traces > 0)
+    traces = malloc(n_traces * sizeof(trace_t*));
+  for (i = 0; i < n_traces; i++)
+    {
+      traces[i] = read_trace(argv[optind + 1 + i]);
+    }
+  if (shard)
+    {
+      trace_t* whole = traces[0];
+      
+      traces = realloc(traces, n_threads * sizeof(trace_t*));
+      for (i = 0; i < n_threads; i++)
+	traces[i] = shard_trace(whole, n_threads, i);
+      n_traces = n_threads;
+    }
+  
+  if (n_items > 0)
+    rings = calloc(n_threads / 2, sizeof(ring_t));
+  
+  worker_t* workers = malloc(n_threads * sizeof(worker_t));
+  pthread_barrier_init(&start_barrier, NULL, n_threads);
+  for (i = 0; i < n_threads; i++)
+    {
+      void* (*body)(void*) = traces ? replay : pairs;
+      
+      workers[i].id = i;
+      workers[i].trace = traces ? traces[i % n_traces] : NULL;
+      workers[i].ring = rings ? &rings[i / 2] : NULL;
+      if (rings)
+	body = i % 2 == 0 ? producer : consumer;
+      if (pthread_create(&workers[i].thread, NULL, body, &workers[i]) != 0)
+	error("unable to create thread", "");
+    }
+  // only this thread looks at the page statistics while they run
+  while (__atomic_load_n(&n_done, __ATOMIC_ACQUIRE) < n_threads)
+    {
+      struct timespec pause = { 0, 1000000 };
+      
+      stat = page_stats();
+      if (stat->num_in_use > peak)
+	peak = stat->num_in_use;
+      nanosleep(&pause, NULL);
+    }
+  for (i = 0; i < n_threads; i++)
+    {
+      worker_t* w = &workers[i];
+      
+      pthread_join(w->thread, NULL);
+      printf("Thread %d: %ld ops in %.3f s, %.0f ops/s, "
+	     "locks %ld, contended %ld\n", i, w->n_ops, w->seconds,
+	     w->n_ops / w->seconds, w->locks, w->contended);
+      n_ops += w->n_ops;
+      locks += w->locks;
+      contended += w->contended;
+      if (w->seconds > elapsed)
+	elapsed = w->seconds;
+    }
+  pthread_barrier_destroy(&start_barrier);
+  
+  // the slowest thread decides the aggregate throughput
+  printf("Operations: %ld in %.3f s, %.0f ops/s\n",
+	 n_ops, elapsed, n_ops / elapsed);
+  printf("Locks: %ld, contended %ld (%.2f%%)\n", locks, contended,
+	 locks ? 100.0 * contended / locks : 0.0);
+  printf("Peak pages in use: %d\n", peak);
+#ifdef KMA_TCACHE
+  long hits, misses, remote;
+  kma_tcache_stats(&hits, &misses, &remote);
+  printf("Thread cache hits/misses: %ld/%ld, hit rate %.1f%%\n",
+	 hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+  printf("Blocks taken from remote-free lists: %ld\n", remote);
+#endif
+#ifdef KMA_HEAP
+  long orphaned, adopted;
+  kma_heap_stats(&orphaned, &adopted);
+  printf("Heaps left by exited threads/adopted: %ld/%ld\n", orphaned, adopted);
+#endif
+#ifdef KMA_MAGAZINE
+  long hits, misses, exchanges;
+  int rounds;
+  kma_magazine_stats(&hits, &misses, &exchanges, &rounds);
+  printf("Magazine hits/misses: %ld/%ld, hit rate %.1f%%\n",
+	 hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+  printf("Depot exchanges: %ld, largest magazine: %d\n", exchanges, rounds);
+  kma_magazine_reclaim(TRUE);
+#endif
+  
+  stat = page_stats();
+  
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+  
+  if(anyMismatches)
+    {
+      error("there were memory mismatches", "");
+    }
+  
+  pass();
+  return 0;
+}
+
+// the operations of a trace on the requests whose id modulo n is t
+trace_t*
+shard_trace(trace_t* whole, int n, int t)
+{
+  trace_t* trace = malloc(sizeof(trace_t));
   int i;
   
-  for (i = 0; i < size; i++)
+  trace->n_req = whole->n_req;
+  trace->ops = malloc(whole->n_ops * sizeof(kma_trace_op_t));
+  trace->n_ops = 0;
+  for (i = 0; i < whole->n_ops; i++)
     {
-      ptr[i] = (char) val++;
+      if (whole->ops[i].id % n == t)
+	trace->ops[trace->n_ops++] = whole->ops[i];
     }
+  return trace;
 }
 
-void
-check(char* lhs, char* rhs, int size)
+// the body of a thread
+void*
+replay(void* arg)
 {
+  worker_t* worker = arg;
+  trace_t* trace = worker->trace;
+  mem_t* requests = malloc((trace->n_req + 1) * sizeof(mem_t));
   int i;
   
-  for (i = 0; i < size; i++)
+  // touch the table before the clock starts
+  memset(requests, 0, (trace->n_req + 1) * sizeof(mem_t));
+  double start = start_clock(worker);
+  
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      kma_trace_op_t* op = &trace->ops[i];
+      mem_t* req = &requests[op->id];
+      int n = op->size / sizeof(int);
+      
+      if (op->op == TRACE_REQUEST)
+	{
+	  req->size = op->size;
+	  req->ptr = kma_malloc(op->size);
+	  if ((req->ptr == NULL) && (req->size <= (PAGESIZE - sizeof(void*))))
+	    {
+	      error("got NULL from kma_malloc for alloc'able request", "");
+	    }
+	  if (req->ptr != NULL && full_check)
+	    fill_pattern(req->ptr, req->size, op->id);
+	  else if (req->ptr != NULL && n > 0)
+	    {
+	      ((int*)req->ptr)[0] = op->id;
+	      ((int*)req->ptr)[n - 1] = op->id;
+	    }
+	}
+      else if (req->ptr != NULL)
+	{
+	  n = req->size / sizeof(int);
+	  if (full_check)
+	    check_pattern(req->ptr, req->size, op->id);
+	  else if (n > 0 && (((int*)req->ptr)[0] != op->id ||
+			     ((int*)req->ptr)[n - 1] != op->id))
+	    {
+	      fprintf(stderr, "memory mismatch in request %d\n", op->id);
+	      anyMismatches = 1;
+	    }
+	  kma_free(req->ptr, req->size);
+	  req->ptr = NULL;
+	}
+    }
+  
+  stop_clock(worker, start, trace->n_ops);
+  free(requests);
+  return NULL;
+}
+
+// with -f a block gets the pattern of its request id (kma_verify.h), so
+// it can be checked without a copy
+void
+fill_pattern(char* ptr, int size, int id)
+{
+  verify_fill(ptr, size, id, 1);
+}
+
+void
+check_pattern(char* ptr, int size, int id)
+{
+  int bad = verify_check(ptr, size, id, 1);
+
+  if (bad >= 0)
+    {
+      fprintf(stderr, "memory mismatch in request %d at position %d\n",
+	      id, bad);
+      anyMismatches = 1;
+    }
+}
+
+// wait for the other threads and start the clock and the lock counts
+double
+start_clock(worker_t* worker)
+{
+  pthread_barrier_wait(&start_barrier);
+  worker->locks = -kma_lock_acquired;
+  worker->contended = -kma_lock_contended;
+  return now();
+}
+
+// stop the clock and the lock counts of a thread that did n_ops
+void
+stop_clock(worker_t* worker, double start, long n_ops)
+{
+  worker->seconds = now() - start;
+  worker->n_ops = n_ops;
+  worker->locks += kma_lock_acquired;
+  worker->contended += kma_lock_contended;
+  __atomic_add_fetch(&n_done, 1, __ATOMIC_RELEASE);
+}
+
+// the body of a thread with -p: every thread keeps its last LIVEPAIRS
+// blocks. a step frees the oldest one, after checking its tags, and
+// allocates a new one of a size class picked at random and a random
+// size in it. the blocks that stay allocated also keep the allocator
+// from freeing all its pages after every pair.
+void*
+pairs(void* arg)
+{
+  worker_t* worker = arg;
+  unsigned int seed = worker->id * 2654435761U + 1;
+  int* live[LIVEPAIRS];
+  int size[LIVEPAIRS];
+  long i;
+  int k;
+  
+  memset(live, 0, sizeof(live));
+  double start = start_clock(worker);
+  
+  for (i = 0; i < n_pairs + LIVEPAIRS; i++)
     {
-      if (lhs[i] != rhs[i])
+      k = i % LIVEPAIRS;
+      if (live[k] != NULL)
 	{
-	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-		  i, lhs[i], rhs[i]);
+	  int n = size[k] / sizeof(int);
+	  
+	  // another thread with the same block would change the tags
+	  if (n > 0 && (live[k][0] != worker->id || live[k][n - 1] != worker->id))
+	    {
+	      fprintf(stderr, "memory mismatch in thread %d\n", worker->id);
+	      anyMismatches = 1;
+	    }
+	  kma_free(live[k], size[k]);
+	  live[k] = NULL;
+	}
+      if (i >= n_pairs)
+	continue;
+      
+      seed = seed * 1103515245 + 12345;
+      size[k] = 1 + (seed >> 16) % (8 << ((seed >> 8) % 9));
+      live[k] = kma_malloc(size[k]);
+      if (live[k] == NULL)
+	error("got NULL from kma_malloc for alloc'able request", "");
+      if (size[k] >= sizeof(int))
+	{
+	  live[k][0] = worker->id;
+	  live[k][size[k] / sizeof(int) - 1] = worker->id;
+	}
+    }
+  
+  stop_clock(worker, start, 2 * n_pairs);
+  return NULL;
+}
+
+// the body of a producer with -c: allocate n_items blocks of random
+// sizes as in pairs, tag them with our id and put them in the ring,
+// waiting for the consumer when it is full
+void*
+producer(void* arg)
+{
+  worker_t* worker = arg;
+  ring_t* ring = worker->ring;
+  unsigned int seed = worker->id * 2654435761U + 1;
+  long i;
+  
+  double start = start_clock(worker);
+  
+  for (i = 0; i < n_items; i++)
+    {
+      unsigned int tail = ring->tail;
+      int size;
+      int* ptr;
+      
+      seed = seed * 1103515245 + 12345;
+      size = 1 + (seed >> 16) % (8 << ((seed >> 8) % 9));
+      ptr = kma_malloc(size);
+      if (ptr == NULL)
+	error("got NULL from kma_malloc for alloc'able request", "");
+      if (size >= sizeof(int))
+	{
+	  ptr[0] = worker->id;
+	  ptr[size / sizeof(int) - 1] = worker->id;
+	}
+      
+      while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RINGSIZE)
+	sched_yield();
+      ring->ptr[tail % RINGSIZE] = ptr;
+      ring->size[tail % RINGSIZE] = size;
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+  
+  stop_clock(worker, start, n_items);
+  return NULL;
+}
+
+// the body of a consumer with -c: take the blocks of the producer
+// before us from the ring, check their tags and free them
+void*
+consumer(void* arg)
+{
+  worker_t* worker = arg;
+  ring_t* ring = worker->ring;
+  int owner = worker->id - 1;
+  long i;
+  
+  double start = start_clock(worker);
+  
+  for (i = 0; i < n_items; i++)
+    {
+      unsigned int head = ring->head;
+      
+      while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+	sched_yield();
+      int* ptr = ring->ptr[head % RINGSIZE];
+      int size = ring->size[head % RINGSIZE];
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+      
+      int n = size / sizeof(int);
+      if (n > 0 && (ptr[0] != owner || ptr[n - 1] != owner))
+	{
+	  fprintf(stderr, "memory mismatch in thread %d\n", worker->id);
 	  anyMismatches = 1;
 	}
+      kma_free(ptr, size);
     }
+  
+  stop_clock(worker, start, n_items);
+  return NULL;
+}
+
+// wall clock time in seconds
+double
+now()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
+#endif // KMA_CONCURRENT
@@ -66,7 +66,13 @@ typedef struct {
 
 /************Global Variables*********************************************/
 
-static kma_page_t* entry_page = NULL;
+static KMA_LOCAL kma_page_t* entry_page = NULL;
+#ifdef KMA_WASTE
+//a block keeps the rest of a free block too small to split, and
+//kma_free gives back the size of the request only. those bytes are
+//not counted anywhere, they are lost until free_all.
+static kma_waste_t waste_count;
+#endif
 
 /************Function Prototypes******************************************/
 void* kma_malloc(kma_size_t);
@@ -103,7 +109,12 @@ kma_malloc(kma_size_t size)
     blk_ptr_t* pos_to_add = (blk_ptr_t*)page_header->free_list;
     int size_to_add = PAGESIZE - sizeof(pg_hdr_t);
 	  add_to_free_list(pos_to_add, size_to_add);
+    WASTE(header, sizeof(pg_hdr_t));
+    WASTE(free, size_to_add);
   }
+  //requests smaller than a free block header are rounded up
+  if (size < sizeof(blk_ptr_t))
+    WASTE(rounding, sizeof(blk_ptr_t) - size);
   blk_ptr_t* block;
   block = find_first_fit(size);
   pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
@@ -164,16 +175,22 @@ blk_ptr_t* find_first_fit(int size) {
   pg_hdr_t* first_page_header = entry_page->ptr;
 
   blk_ptr_t* prev = NULL;
-  blk_ptr_t* current = first_page_header->free_list;;
+  blk_ptr_t* current = first_page_header->free_list;
+  //the list is empty when the blocks fill the pages exactly
+  if (current == NULL) {
+    goto new_page;
+  }
   if (current->size >= size) {
     if (current->size == size || current->size - size < min_size) {
       first_page_header->free_list = current->next; 
+      WASTE(free, -current->size);
     }
     else {
     	first_page_header->free_list = current->next; 
     	blk_ptr_t* pos_to_add = (blk_ptr_t*)((void*)current + size);
     	int size_to_add = current->size - size;
       add_to_free_list(pos_to_add, size_to_add);
+      WASTE(free, -size);
     }
     return current;
   }
@@ -184,12 +201,14 @@ blk_ptr_t* find_first_fit(int size) {
     if (current->size >= size) {
       if (current->size == size || current->size - size < min_size) {
         prev->next = current->next; 
+        WASTE(free, -current->size);
       }
       else {
       	prev->next = current->next; 
     		blk_ptr_t* pos_to_add = (blk_ptr_t*)((void*)current + size);
     		int size_to_add = current->size - size;
       	add_to_free_list(pos_to_add, size_to_add);
+        WASTE(free, -size);
       }
       return current;
     }
@@ -197,6 +216,7 @@ blk_ptr_t* find_first_fit(int size) {
     current = current->next;
   }//while end
   //get a new page if there is no block found
+ new_page:;
   kma_page_t* new_page = get_page();
   *((kma_page_t**)(new_page->ptr)) = new_page;
   pg_hdr_t* page_header = (pg_hdr_t*)(new_page->ptr);  
@@ -207,6 +227,8 @@ blk_ptr_t* find_first_fit(int size) {
   void* pos_to_add = (void*)page_header + sizeof(pg_hdr_t) + size;
   int size_to_add = PAGESIZE - sizeof(pg_hdr_t)-size;
   add_to_free_list((blk_ptr_t*)pos_to_add, size_to_add);
+  WASTE(header, sizeof(pg_hdr_t));
+  WASTE(free, size_to_add);
 
   (first_page_header->total_pages)++;
   //not recursion
@@ -218,6 +240,9 @@ kma_free(void* ptr, kma_size_t size)
 {
   blk_ptr_t* block = (blk_ptr_t*)ptr;
   add_to_free_list(block, size);
+  WASTE(free, size);
+  if (size < sizeof(blk_ptr_t))
+    WASTE(rounding, size - (long) sizeof(blk_ptr_t));
  	coalesce();
   pg_hdr_t* first_page = entry_page->ptr;
   (first_page->freed_block)++;
@@ -240,6 +265,7 @@ void free_all() {
     i++;
   }
   entry_page = NULL;
+  WASTE_RESET();
 }
 //traverse the whole free_list
 void coalesce() {
@@ -259,4 +285,23 @@ void coalesce() {
 	}
 }
 
+#ifdef KMA_WASTE
+void kma_waste(kma_waste_t* waste) {
+  *waste = waste_count;
+}
+#endif
+
+#ifdef KMA_HEAP
+//the roots of the heap of this thread go to another one
+void kma_heap_save(kma_heap_t* heap) {
+  heap->root = entry_page;
+  heap->count = 0;
+  entry_page = NULL;
+}
+
+void kma_heap_load(kma_heap_t* heap) {
+  entry_page = heap->root;
+}
+#endif
+
 #endif // KMA_RM
\ No newline at end of file
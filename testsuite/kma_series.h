@@ -0,0 +1,200 @@
+/***************************************************************************
+ *  Title: Time Series
+ * -------------------------------------------------------------------------
+ *    Purpose: The curves of the harness (bytes requested and allocated,
+ *             the parts of the waste) as a binary file written through a
+ *             buffer, instead of a line of text after every operation.
+ *             Every interval operations make a window; a window keeps
+ *             its last sample, or with minmax the samples with the
+ *             smallest and largest value of a key column, so the peaks
+ *             are still in the plot. kma_series turns a file into text
+ *             for gnuplot.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_SERIES_H__
+#define __KMA_SERIES_H__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// the first bytes of a series file
+#define KMA_SERIES_MAGIC "KMASER01"
+
+// values of a sample at most, the index (operation) is the first
+#define SERIES_COLUMNS 8
+
+// values written at once
+#define SERIES_BUFFER 8192
+
+// the header of a file, samples of columns long longs follow
+typedef struct
+{
+  char magic[8];
+  int columns;
+  int interval;
+  int minmax;
+  int key; // the column of minmax, -1 for the sum of the values
+  char names[96]; // the names of the columns, separated by spaces
+} kma_series_header_t;
+
+typedef struct
+{
+  FILE* file;
+  kma_series_header_t header;
+  long long last[SERIES_COLUMNS]; // the samples of the window
+  long long min[SERIES_COLUMNS];
+  long long max[SERIES_COLUMNS];
+  long long min_key, max_key;
+  int count; // samples in the window
+  int used; // values in the buffer
+  long long buffer[SERIES_BUFFER];
+} series_t;
+
+/************Global Variables*********************************************/
+
+/**************Definition***************************************************/
+
+static inline void
+series_write(series_t* s, long long* sample)
+{
+  int n = s->header.columns;
+
+  if (s->used + n > SERIES_BUFFER)
+    {
+      fwrite(s->buffer, sizeof(long long), s->used, s->file);
+      s->used = 0;
+    }
+  memcpy(&s->buffer[s->used], sample, n * sizeof(long long));
+  s->used += n;
+}
+
+// the samples a window keeps: the extremes in the order they came, and
+// the last sample if it is neither, so the end of every window is there
+static inline void
+series_window(series_t* s)
+{
+  if (s->header.minmax)
+    {
+      long long* first = s->min[0] < s->max[0] ? s->min : s->max;
+      long long* second = first == s->min ? s->max : s->min;
+
+      series_write(s, first);
+      if (second[0] != first[0])
+	series_write(s, second);
+      if (s->last[0] != second[0])
+	series_write(s, s->last);
+    }
+  else
+    series_write(s, s->last);
+  s->count = 0;
+}
+
+/***********************************************************************
+ *  Title: Open a series
+ * ---------------------------------------------------------------------
+ *    Purpose: Start the file of a series with the names of its columns
+ *             (the first is the index), the operations of a window and
+ *             whether a window keeps its smallest and largest sample by
+ *             column key (-1: by the sum of the values) or its last one
+ *    Output: the series, NULL if the file cannot be opened
+ ***********************************************************************/
+static inline series_t*
+series_open(char* file, char* names, int interval, int minmax, int key)
+{
+  series_t* s = malloc(sizeof(series_t));
+  char* p;
+
+  if (s == NULL || (s->file = fopen(file, "wb")) == NULL)
+    {
+      free(s);
+      return NULL;
+    }
+  memset(&s->header, 0, sizeof(s->header));
+  memcpy(s->header.magic, KMA_SERIES_MAGIC, sizeof(s->header.magic));
+  s->header.columns = 1;
+  for (p = names; *p; p++)
+    if (*p == ' ')
+      s->header.columns++;
+  assert(s->header.columns <= SERIES_COLUMNS);
+  s->header.interval = interval > 0 ? interval : 1;
+  s->header.minmax = minmax;
+  s->header.key = key;
+  strncpy(s->header.names, names, sizeof(s->header.names) - 1);
+  fwrite(&s->header, sizeof(s->header), 1, s->file);
+  s->count = 0;
+  s->used = 0;
+  return s;
+}
+
+/***********************************************************************
+ *  Title: Add a sample
+ * ---------------------------------------------------------------------
+ *    Purpose: Add the values of one operation; the window is written
+ *             when it is full. A copy of a few values, the file is only
+ *             written when the buffer is full.
+ ***********************************************************************/
+static inline void
+series_add(series_t* s, long long* sample)
+{
+  int n = s->header.columns, i;
+
+  if (s->header.minmax)
+    {
+      long long key = 0;
+
+      if (s->header.key >= 0)
+	key = sample[s->header.key];
+      else
+	for (i = 1; i < n; i++)
+	  key += sample[i];
+      if (s->count == 0 || key < s->min_key)
+	{
+	  memcpy(s->min, sample, n * sizeof(long long));
+	  s->min_key = key;
+	}
+      if (s->count == 0 || key > s->max_key)
+	{
+	  memcpy(s->max, sample, n * sizeof(long long));
+	  s->max_key = key;
+	}
+    }
+  memcpy(s->last, sample, n * sizeof(long long));
+  if (++s->count == s->header.interval)
+    series_window(s);
+}
+
+/***********************************************************************
+ *  Title: Close a series
+ * ---------------------------------------------------------------------
+ *    Purpose: Write the window that is not full and the buffer
+ ***********************************************************************/
+static inline void
+series_close(series_t* s)
+{
+  if (s->count > 0)
+    series_window(s);
+  fwrite(s->buffer, sizeof(long long), s->used, s->file);
+  fclose(s->file);
+  free(s);
+}
+
+#endif /* __KMA_SERIES_H__ */
@@ -0,0 +1,180 @@
+/***************************************************************************
+ *  Title: Binary Traces
+ * -------------------------------------------------------------------------
+ *    Purpose: The binary trace format. A header with the number of
+ *             requests and operations is followed by one fixed-width
+ *             record per line of the text trace, so the test harness
+ *             maps the file and replays the records without parsing.
+ *             kma_trace converts a text trace, read_trace reads both
+ *             (for kma.c and kma_bench).
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_TRACE_H__
+#define __KMA_TRACE_H__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// the first bytes of a binary trace, a text trace starts with a number
+#define KMA_TRACE_MAGIC "KMATRC01"
+
+// the op of a record
+#define TRACE_FREE 0
+#define TRACE_REQUEST 1
+
+// the file starts with the header, the records follow. Ints are in the
+// byte order of the machine that converted the trace. The header is 16
+// bytes, so the records that follow it are aligned.
+typedef struct
+{
+  char magic[8];
+  int n_req; // the number at the head of the text trace
+  int n_ops; // the records that follow
+} kma_trace_header_t;
+
+// one line of a trace, size is 0 for FREE
+typedef struct
+{
+  int op;
+  int id;
+  int size;
+} kma_trace_op_t;
+
+// a whole trace, read before the replay starts. The operations of a
+// binary trace are mapped from the file, a text trace is parsed into
+// the same records.
+typedef struct
+{
+  int n_req;
+  int n_ops;
+  kma_trace_op_t* ops;
+} trace_t;
+
+/************Function Prototypes******************************************/
+
+// prints the message and fails, every program that reads traces has one
+void error(char*, char*);
+
+static inline trace_t* map_trace(FILE*, kma_trace_header_t*, char*);
+
+/**************Definition***************************************************/
+
+// read a whole trace file, a binary trace is mapped, a text trace parsed
+static inline trace_t*
+read_trace(char* file)
+{
+  FILE* f_test = fopen(file, "r");
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+  
+  kma_trace_header_t header;
+  if (fread(&header, sizeof(header), 1, f_test) == 1 &&
+      memcmp(header.magic, KMA_TRACE_MAGIC, sizeof(header.magic)) == 0)
+    {
+      return map_trace(f_test, &header, file);
+    }
+  rewind(f_test);
+  
+  trace_t* trace = malloc(sizeof(trace_t));
+  if (fscanf(f_test, "%d\n", &trace->n_req) != 1)
+    error("Couldn't read number of requests at head of file", file);
+  
+  int max_ops = 2 * trace->n_req + 2;
+  trace->ops = malloc(max_ops * sizeof(kma_trace_op_t));
+  trace->n_ops = 0;
+  
+  char command[16];
+  while (fscanf(f_test, "%10s", command) == 1)
+    {
+      // a generated trace may use the ids of freed requests again
+      if (trace->n_ops == max_ops)
+	{
+	  max_ops *= 2;
+	  trace->ops = realloc(trace->ops, max_ops * sizeof(kma_trace_op_t));
+	  if (trace->ops == NULL)
+	    error("out of memory reading", file);
+	}
+      
+      kma_trace_op_t* op = &trace->ops[trace->n_ops];
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  op->op = TRACE_REQUEST;
+	  if (fscanf(f_test, "%d %d", &op->id, &op->size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  op->op = TRACE_FREE;
+	  op->size = 0;
+	  if (fscanf(f_test, "%d", &op->id) != 1)
+	    error("Not enough arguments to FREE", "");
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+      assert(op->id >= 0 && op->id < trace->n_req);
+      trace->n_ops++;
+    }
+  fclose(f_test);
+  return trace;
+}
+
+// map the records of a binary trace, they stay mapped until the end
+static inline trace_t*
+map_trace(FILE* f_test, kma_trace_header_t* header, char* file)
+{
+  struct stat st;
+  int i;
+  
+  if (fstat(fileno(f_test), &st) != 0 || header->n_req < 0 ||
+      header->n_ops < 0 || st.st_size != sizeof(kma_trace_header_t) +
+      (long) header->n_ops * sizeof(kma_trace_op_t))
+    error("truncated binary trace", file);
+  
+  char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		   fileno(f_test), 0);
+  if (map == MAP_FAILED)
+    error("unable to map", file);
+  fclose(f_test);
+  
+  trace_t* trace = malloc(sizeof(trace_t));
+  trace->n_req = header->n_req;
+  trace->n_ops = header->n_ops;
+  trace->ops = (kma_trace_op_t*) (map + sizeof(kma_trace_header_t));
+  
+  // the replay trusts the records like the parsed ones
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      kma_trace_op_t* op = &trace->ops[i];
+      if ((op->op != TRACE_REQUEST && op->op != TRACE_FREE) ||
+	  op->id < 0 || op->id >= trace->n_req)
+	error("bad record in binary trace", file);
+    }
+  return trace;
+}
+
+#endif /* __KMA_TRACE_H__ */
@@ -0,0 +1,221 @@
+/***************************************************************************
+ *  Title: Block Verification
+ * -------------------------------------------------------------------------
+ *    Purpose: Fills a block with a pattern computed from its request id
+ *             and the offset in the block, and checks it later against
+ *             the same pattern, so the harness needs no copy of every
+ *             block. Both run on vectors of 4 words (the vector extension
+ *             of gcc, two SSE2 registers on x86-64). With sampling only
+ *             1 in k blocks get the whole pattern, the others only their
+ *             first and last VERIFY_EDGE bytes, where the headers of the
+ *             allocators and the blocks next to them are.
+ *    Author: kernel-memory-allocator contributors
+ *    Copyright: the kernel-memory-allocator contributors
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KMA_VERIFY_H__
+#define __KMA_VERIFY_H__
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// bytes at either end of a block that are always filled and checked
+#define VERIFY_EDGE 16
+
+// the difference of two words of the pattern (odd, so the words of a
+// block are all different)
+#define VERIFY_STEP 0x9e3779b97f4a7c15ULL
+
+typedef unsigned long long verify_word_t;
+typedef verify_word_t verify_vec_t __attribute__((vector_size(32)));
+
+#define VERIFY_LANES ((int) (sizeof(verify_vec_t) / sizeof(verify_word_t)))
+
+/**************Definition***************************************************/
+
+/***********************************************************************
+ *  Title: Pattern
+ * ---------------------------------------------------------------------
+ *    Purpose: The first word of the pattern of a request id (the ids
+ *             are scrambled so blocks of neighbouring ids differ in all
+ *             bytes), word k is that plus k * VERIFY_STEP. Byte i of a
+ *             block is byte i % 8 of word i / 8.
+ ***********************************************************************/
+static inline verify_word_t
+verify_seed(int id)
+{
+  verify_word_t x = (verify_word_t) id + VERIFY_STEP;
+
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static inline unsigned char
+verify_byte(verify_word_t seed, int i)
+{
+  verify_word_t w = seed + (verify_word_t) (i / 8) * VERIFY_STEP;
+
+  return ((unsigned char*) &w)[i % 8];
+}
+
+/***********************************************************************
+ *  Title: Fill a range
+ * ---------------------------------------------------------------------
+ *    Purpose: Write the pattern of bytes from to to of a block (from is
+ *             a multiple of 8): whole vectors, whole words, then bytes
+ ***********************************************************************/
+static inline void
+verify_fill_range(char* ptr, verify_word_t seed, int from, int to)
+{
+  int i = from, k;
+  verify_vec_t v, step;
+
+  for (k = 0; k < VERIFY_LANES; k++)
+    {
+      v[k] = seed + (verify_word_t) (i / 8 + k) * VERIFY_STEP;
+      step[k] = VERIFY_LANES * VERIFY_STEP;
+    }
+  for (; i + (int) sizeof(v) <= to; i += sizeof(v))
+    {
+      memcpy(ptr + i, &v, sizeof(v));
+      v += step;
+    }
+  for (; i + 8 <= to; i += 8)
+    {
+      verify_word_t w = seed + (verify_word_t) (i / 8) * VERIFY_STEP;
+
+      memcpy(ptr + i, &w, 8);
+    }
+  for (; i < to; i++)
+    ptr[i] = verify_byte(seed, i);
+}
+
+/***********************************************************************
+ *  Title: Check a range
+ * ---------------------------------------------------------------------
+ *    Purpose: Compare bytes from to to of a block (from is a multiple of
+ *             8) with the pattern, the differences of a vector are or'ed
+ *             together and looked at once
+ *    Output: the offset of the first wrong byte, -1 if there is none
+ ***********************************************************************/
+static inline int
+verify_check_range(char* ptr, verify_word_t seed, int from, int to)
+{
+  int i = from, k;
+  verify_vec_t v, step, diff;
+  verify_word_t any = 0;
+
+  for (k = 0; k < VERIFY_LANES; k++)
+    {
+      v[k] = seed + (verify_word_t) (i / 8 + k) * VERIFY_STEP;
+      step[k] = VERIFY_LANES * VERIFY_STEP;
+      diff[k] = 0;
+    }
+  for (; i + (int) sizeof(v) <= to; i += sizeof(v))
+    {
+      verify_vec_t m;
+
+      memcpy(&m, ptr + i, sizeof(m));
+      diff |= m ^ v;
+      v += step;
+    }
+  for (k = 0; k < VERIFY_LANES; k++)
+    any |= diff[k];
+  for (; i + 8 <= to; i += 8)
+    {
+      verify_word_t w = seed + (verify_word_t) (i / 8) * VERIFY_STEP, m;
+
+      memcpy(&m, ptr + i, 8);
+      any |= m ^ w;
+    }
+  for (; i < to; i++)
+    any |= (unsigned char) ptr[i] ^ verify_byte(seed, i);
+  if (any == 0)
+    return -1;
+
+  // something is wrong, find the first byte
+  for (i = from; i < to; i++)
+    if ((unsigned char) ptr[i] != verify_byte(seed, i))
+      return i;
+  return -1;
+}
+
+/***********************************************************************
+ *  Title: Sampled blocks
+ * ---------------------------------------------------------------------
+ *    Purpose: Whether the block of a request id gets the whole pattern
+ *             with 1 in sample blocks checked (spread over the ids by
+ *             the scrambled id)
+ ***********************************************************************/
+static inline int
+verify_sampled(int id, int sample)
+{
+  return sample <= 1 || verify_seed(id) % sample == 0;
+}
+
+// the ranges of a block that get the pattern: all of it, or the edges
+// (the last one starts at a multiple of 8)
+static inline void
+verify_edges(int size, int* head, int* tail)
+{
+  *head = VERIFY_EDGE < size ? VERIFY_EDGE : size;
+  *tail = (size - VERIFY_EDGE) & ~7;
+  if (*tail < *head)
+    *tail = *head;
+}
+
+/***********************************************************************
+ *  Title: Fill and check a block
+ * ---------------------------------------------------------------------
+ *    Purpose: Give a block the pattern of its request id, and check it
+ *             (the whole block if it is sampled, else its edges)
+ *    Output: verify_check returns the offset of the first wrong byte,
+ *            -1 if the block is fine
+ ***********************************************************************/
+static inline void
+verify_fill(char* ptr, int size, int id, int sample)
+{
+  verify_word_t seed = verify_seed(id);
+  int head, tail;
+
+  if (verify_sampled(id, sample))
+    {
+      verify_fill_range(ptr, seed, 0, size);
+      return;
+    }
+  verify_edges(size, &head, &tail);
+  verify_fill_range(ptr, seed, 0, head);
+  verify_fill_range(ptr, seed, tail, size);
+}
+
+static inline int
+verify_check(char* ptr, int size, int id, int sample)
+{
+  verify_word_t seed = verify_seed(id);
+  int head, tail, bad;
+
+  if (verify_sampled(id, sample))
+    return verify_check_range(ptr, seed, 0, size);
+  verify_edges(size, &head, &tail);
+  if ((bad = verify_check_range(ptr, seed, 0, head)) >= 0)
+    return bad;
+  return verify_check_range(ptr, seed, tail, size);
+}
+
+#endif /* __KMA_VERIFY_H__ */